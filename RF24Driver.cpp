@@ -1,4 +1,9 @@
 #include "RF24Driver.hpp"
+#include "rf24log.hpp"
+#ifndef ARDUINO
+ #include <errno.h>
+ #include <time.h>
+#endif
 
 RF24Driver::RF24Driver()
 {
@@ -6,13 +11,82 @@ RF24Driver::RF24Driver()
   m_address_len = PACKET_DRIVER_MAX_ADDRESS_LEN ;
   m_payload_width = MAX_RXTXBUF - PACKET_DRIVER_MAX_ADDRESS_LEN ;
   m_sendstatus = Status::waiting ;
+  m_pipe_callbackfn = NULL ;
+  m_pipe_clock = 0 ;
+  m_next_low_byte = 0 ;
+  m_warm_start = false ;
+  memset(m_peer_pipes, 0, sizeof(m_peer_pipes)) ;
+  memset(m_handlers, 0, sizeof(m_handlers)) ;
+  m_handler_count = 0 ;
+  m_handler_lengths = 0 ;
+  memset(m_seq_windows, 0, sizeof(m_seq_windows)) ;
+  m_seq_clock = 0 ;
+  m_sequence = false ;
+  // Start at an arbitrary number so a restarted sender is unlikely to
+  // repeat numbers receivers still hold
+  m_tx_sequence = (uint8_t)rf24_micros() ;
+  m_duplicates = 0 ;
+  m_short_frames = 0 ;
+#ifndef ARDUINO
+  m_workers = NULL ;
+  m_worker_count.store(0) ;
+  m_dispatch_running.store(false) ;
+  m_dispatch_drops.store(0) ;
+  m_overflow = drop_newest ;
+  m_rx_drops.store(0) ;
+  m_tx_classes = NULL ;
+  m_tx_peers = NULL ;
+  m_tx_rr = 0 ;
+  m_tx_held = 0 ;
+  m_tx_peer_clock = 0 ;
+  m_tx_rate_us.store(0) ;
+  m_tx_burst_us.store(0) ;
+  m_tx_frame_us = 0 ;
+  m_tx_ard_us = 0 ;
+  m_tx_schedule = tx_strict ;
+  m_tx_turn = 0 ;
+  m_tx_credit = 0 ;
+  m_tx_running.store(false) ;
+  m_tx_callbackfn = NULL ;
+  pthread_mutex_init(&m_tx_statlock, NULL) ;
+  sem_init(&m_tx_done, 0, 0) ;
+  pthread_mutexattr_t attr ;
+  pthread_mutexattr_init(&attr) ;
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK) ;
+  pthread_mutex_init(&m_send_lock, &attr) ;
+  pthread_mutexattr_destroy(&attr) ;
+#endif
+}
+
+RF24Driver::~RF24Driver()
+{
+#ifndef ARDUINO
+  stop_dispatch() ;
+  delete [] m_workers ;
+  stop_tx_queue() ;
+  delete [] m_tx_classes ;
+  delete [] m_tx_peers ;
+  pthread_mutex_destroy(&m_tx_statlock) ;
+  sem_destroy(&m_tx_done) ;
+  pthread_mutex_destroy(&m_send_lock) ;
+#endif
+}
+
+void RF24Driver::set_warm_start(bool warm)
+{
+  m_warm_start = warm ;
 }
 
 bool RF24Driver::initialise(uint8_t *device, uint8_t *broadcast, uint8_t length)
 {
+  bool powered = false ;
   m_address_len = length ;
   memcpy(m_device, device, length) ;
   memcpy(m_broadcast, broadcast, length) ;
+  // Peer pipes are not part of the configuration so start unallocated
+  memset(m_peer_pipes, 0, sizeof(m_peer_pipes)) ;
+  memset(m_seq_windows, 0, sizeof(m_seq_windows)) ;
+  m_next_low_byte = device[0] + 1 ;
 
   // Check if driver is missing port interfaces
   if (!m_pGPIO || !m_pSPI) return false ;
@@ -25,48 +99,63 @@ bool RF24Driver::initialise(uint8_t *device, uint8_t *broadcast, uint8_t length)
   if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)){
     return false ;
   }
-  // Reset device
-  power_up(false);
-  reset_rf24() ;
+  if (m_warm_start){
+    // Keep the radio running and compare the registers it already holds
+    // with the configuration below. Only differences are written
+    RF24Registers current ;
+    if (!read_registers(current)) return false ;
+    powered = current.is_powered_up() ;
+    // Stale interrupt flags from the previous run hold IRQ low
+    // and no further falling edge would be seen
+    clear_interrupts() ;
+  }else{
+    // Reset device
+    power_up(false);
+    reset_rf24() ;
+  }
   flushtx() ;
   flushrx() ;
+
+  RadioConfig config ;
   // Set all interrupts. This is important as they are used to read and write data
-  set_use_interrupt_data_ready(true);
-  set_use_interrupt_data_sent(true);
-  set_use_interrupt_max_retry(true);
+  config.interrupt_data_ready = true ;
+  config.interrupt_data_sent = true ;
+  config.interrupt_max_retry = true ;
   
-  m_address_len = length ;
-  if (!set_address_width(length)) return false ; // invalid width
-  set_retry(15,15);
+  config.address_width = length ;
+  config.retry_delay = 15 ;
+  config.retry_count = 15 ;
   // User pipe 0 to receive transmitted responses or listen
   // on broadcast address
-  enable_pipe(0, true) ;
+  config.pipe[0].enabled = true ;
   // Use pipe 1 for receiving unicast data
-  enable_pipe(1, true) ;
+  config.pipe[1].enabled = true ;
 
   // Don't use ACKs - reduce radio noise and handle in protocol
-  set_pipe_ack(0, false) ;
-  set_pipe_ack(1, false) ;
-  set_power_level(RF24_0DBM) ; // Max power
-  crc_enabled(true) ;
-  set_2_byte_crc(true) ;
-  set_data_rate(RF24_2MBPS) ; // Highest speed
+  config.pipe[0].ack = false ;
+  config.pipe[1].ack = false ;
+  config.power_level = RF24_0DBM ; // Max power
+  config.crc = true ;
+  config.crc_2byte = true ;
+  config.data_rate = RF24_2MBPS ; // Highest speed
 
   // Set default payload width
-  if (!NordicRF24::set_payload_width(0,MAX_RXTXBUF))return false ;
-  if (!NordicRF24::set_payload_width(1,MAX_RXTXBUF)) return false ;
-  if (!NordicRF24::set_transmit_width(MAX_RXTXBUF)) return false ;
+  config.pipe[0].width = MAX_RXTXBUF ;
+  config.pipe[1].width = MAX_RXTXBUF ;
+  config.transmit_width = MAX_RXTXBUF ;
 
-  if (!set_rx_address(0, m_broadcast, m_address_len)){
-    return false ;
-  }
+  if (!config.set_rx_address(0, m_broadcast)) return false ;
+  if (!config.set_rx_address(1, m_device)) return false ;
 
-  if (!set_rx_address(1, m_device, m_address_len)){
-    return false ;
-  }
+  // Registers are written back to back and only where they differ
+  // from the reset state. Fails on invalid width
+  if (!apply(config)) return false ;
 
-  m_pTimer->microSleep(5000) ; // 1.5 ms settle
-  power_up(true) ;
+  if (!powered){
+    m_pTimer->microSleep(5000) ; // 1.5 ms settle
+    power_up(true) ;
+    set_state(rf24_standby, 0) ;
+  }
 
   listen_mode() ;
 
@@ -81,6 +170,7 @@ bool RF24Driver::shutdown()
 
   // Power down
   power_up(false) ;
+  set_state(rf24_power_down, 0) ;
   flushrx() ;
   flushtx() ;
   clear_interrupts() ;
@@ -90,17 +180,27 @@ bool RF24Driver::shutdown()
 
 bool RF24Driver::set_payload_width(uint8_t width)
 {
-  if (width > MAX_RXTXBUF - m_address_len) return false ;
-  if (!NordicRF24::set_payload_width(0,width+m_address_len)) return false ;
-  if (!NordicRF24::set_payload_width(1,width+m_address_len)) return false ;
-  if (!NordicRF24::set_transmit_width(width+m_address_len)) return false ;
-  m_payload_width = width ;
+  uint8_t header = header_len() ;
+  if (width > MAX_RXTXBUF - header) return false ;
+  if (!NordicRF24::set_payload_width(0,width+header)) return false ;
+  if (!NordicRF24::set_payload_width(1,width+header)) return false ;
+  if (!NordicRF24::set_transmit_width(width+header)) return false ;
+  // Held as the frame size after the address
+  m_payload_width = width + header - m_address_len ;
   return true ;
 }
 
 uint8_t RF24Driver::get_payload_width()
 {
-  return m_payload_width ;
+  return m_payload_width - (m_sequence?1:0) ;
+}
+
+bool RF24Driver::set_sequence(bool enable)
+{
+  // Frame size is unchanged. The sequence number comes out of the payload
+  if (enable && m_payload_width == 0) return false ;
+  m_sequence = enable ;
+  return true ;
 }
 
 bool RF24Driver::send_mode()
@@ -108,23 +208,18 @@ bool RF24Driver::send_mode()
   if (!m_pGPIO){
     return false; // Terminal problem - GPIO interface required
   }
-#ifndef ARDUINO
-  pthread_mutex_lock(&m_rwlock) ;
-#endif
+  lock() ;
   if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false;
   }
 
   receiver(false);
 
-  m_pTimer->microSleep(130); // 130 micro second wait
+  // Callers wait for the 130 micro second settle outside of the lock
+  set_state(rf24_tx_settling, RF24_SETTLE_US) ;
   
-#ifndef ARDUINO
-  pthread_mutex_unlock(&m_rwlock) ;
-#endif
+  unlock() ;
 
   return true;
 }
@@ -135,136 +230,926 @@ bool RF24Driver::listen_mode()
     return false ;
   }
 
-#ifndef ARDUINO
-  pthread_mutex_lock(&m_rwlock) ;
-#endif
+  lock() ;
   if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false ; // Terminal problem
   }
 
   // Set pipe 0 to listen on the broadcast address
   if (!set_rx_address(0, m_broadcast, m_address_len)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false;
   }
   receiver(true);
 
-  // 130 micro second wait recommended in RF24 spec
-  m_pTimer->microSleep(130); 
-
   if (!m_pGPIO->output(m_ce, IHardwareGPIO::high)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false; // Fairly terminal error if GPIO cannot be set
   }
-  m_pTimer->microSleep(4);
+  // RX settling of 130 micro seconds recommended in RF24 spec starts
+  // with CE high. Nothing needs to wait for it so the lock is released
+  set_state(rf24_rx_settling, RF24_SETTLE_US) ;
 
   // Flushing RX & TX and clearing interrupts not required to change to listen mode (or send mode)
 
-#ifndef ARDUINO
-  pthread_mutex_unlock(&m_rwlock) ;
-#endif
+  unlock() ;
 
   return true ;
 }
 bool RF24Driver::max_retry_interrupt()
 {
+  lock() ;
   flushtx();
+  unlock() ;
   m_sendstatus = Status::failed ;
+#ifndef ARDUINO
+  sem_post(&m_tx_done) ;
+  m_tx_event.signal() ;
+#endif
   return true ;
 }
 
 bool RF24Driver::data_sent_interrupt()
 {
   m_sendstatus = Status::delivered ;
+#ifndef ARDUINO
+  sem_post(&m_tx_done) ;
+  m_tx_event.signal() ;
+#endif
   return true ;
 }
 
 bool RF24Driver::data_received_interrupt()
 {
-  uint8_t packet[MAX_RXTXBUF] ;
+#ifdef ARDUINO
+  // Frames are delivered as they are read to keep the stack small.
+  // There is no lock to release first
+  RxFrame frames[1] ;
+#else
+  RxFrame frames[RF24_RX_FIFO] ;
+#endif
+  uint8_t count = 0 ;
+  bool ret = true ;
 #ifndef ARDUINO
-  pthread_mutex_lock(&m_rwlock) ;
+  bool queued = false ;
 #endif
-  uint8_t pipe = get_pipe_available();
-  
-  if (pipe == RF24_PIPE_EMPTY){
+
+  // Drain the FIFO under the lock. Callbacks are run once it is released.
+  // Reads are bounded by the FIFO depth, including frames which are dropped
+  lock() ;
+  for (uint8_t reads=0; reads < RF24_RX_FIFO && !is_rx_empty(); reads++){
+    RxFrame &frame = frames[count] ;
+    uint8_t pipe = get_pipe_available() ;
+    if (pipe == RF24_PIPE_EMPTY) break ; // no pipe
+    touch_pipe(pipe) ;
+    uint8_t size = get_rx_data_size(pipe) ;
+    if (!read_payload(frame.packet, size)){
+      ret = false ;
+      break ;
+    }
+    if (size < header_len()){
+      // No sender address or sequence number to use
+      m_short_frames++ ;
+      if (size == 0) break ; // width read failed and nothing was read
+      continue ;
+    }
+    if (m_sequence && is_duplicate(frame.packet, frame.packet[m_address_len])){
+      m_duplicates++ ;
+      continue ;
+    }
+    // Copy the callback out so the table can change once unlocked
+    PeerHandler *handler = find_handler(frame.packet) ;
+    if (handler){
+      frame.fn = handler->fn ;
+      frame.pipefn = NULL ;
+      frame.context = handler->context ;
+    }else{
+      frame.fn = m_callbackfn ;
+      frame.pipefn = m_pipe_callbackfn ;
+      frame.context = m_callbackcontext ;
+    }
+    frame.pipe = pipe ;
+    frame.header = header_len() ;
+    frame.size = size ;
 #ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
+    if (!handler && m_rx_event.is_open()){
+      // Held for receive in place of the data received callback
+      if (m_rx_queue.push(frame)) queued = true ;
+      else m_rx_drops.fetch_add(1, std::memory_order_relaxed) ;
+      continue ;
+    }
+    count++ ;
+#else
+    if (!deliver(frame)) ret = false ;
 #endif
-    return true ; // no pipe
   }
-
-  uint8_t size = get_rx_data_size(pipe) ;
-  
-  while (!is_rx_empty()){
-    bool ret = read_payload(packet, size) ;
+  unlock() ;
 #ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
+  if (queued) m_rx_event.signal() ;
 #endif
-    if (!ret){
-      return false ;
+
+  for (uint8_t i=0; i < count; i++){
+#ifndef ARDUINO
+    if (m_worker_count.load(std::memory_order_acquire) > 0){
+      dispatch(frames[i]) ;
+      continue ;
     }
-    return (*m_callbackfn)(m_callbackcontext, packet, packet+m_address_len) ;
-  }  
+#endif
+    if (!deliver(frames[i])) ret = false ;
+  }
+  return ret ;
+}
+
+bool RF24Driver::deliver(RxFrame &frame)
+{
+  uint8_t *data = frame.packet + frame.header ;
+  if (frame.pipefn)
+    return (*frame.pipefn)(frame.context, frame.packet, data, frame.pipe) ;
+  if (frame.fn) return (*frame.fn)(frame.context, frame.packet, data) ;
+  return true ;
+}
+
+bool RF24Driver::lock_send()
+{
 #ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
+  return pthread_mutex_lock(&m_send_lock) == 0 ;
+#else
+  return true ;
+#endif
+}
+
+void RF24Driver::unlock_send()
+{
+#ifndef ARDUINO
+  pthread_mutex_unlock(&m_send_lock) ;
 #endif
-  return false ;
 }
 
 bool RF24Driver::send(const uint8_t *receiver, uint8_t *data, uint8_t len)
+{
+  if (!lock_send()) return false ;
+  bool ret = send_frame(receiver, data, len, ++m_tx_sequence) ;
+  unlock_send() ;
+  return ret ;
+}
+
+bool RF24Driver::retransmit(const uint8_t *receiver, uint8_t *data, uint8_t len)
+{
+  if (!lock_send()) return false ;
+  bool ret = send_frame(receiver, data, len, m_tx_sequence) ;
+  unlock_send() ;
+  return ret ;
+}
+
+bool RF24Driver::send_frame(const uint8_t *receiver, uint8_t *data, uint8_t len, uint8_t sequence)
+{
+#ifndef ARDUINO
+  // Clear posts left by sends which were not waited on
+  while (sem_trywait(&m_tx_done) == 0) ;
+#endif
+  if (!start_frame(receiver, data, len, sequence)) return false ;
+
+  // Wait for send status to update or quit after 250 ms
+#ifdef ARDUINO
+  for (uint16_t i=0;m_sendstatus == Status::waiting && i < 2500; i++){
+    m_pTimer->microSleep(100) ;
+  }
+#else
+  struct timespec deadline ;
+  clock_gettime(CLOCK_REALTIME, &deadline) ;
+  deadline.tv_nsec += 250000000 ;
+  if (deadline.tv_nsec >= 1000000000){
+    deadline.tv_sec++ ;
+    deadline.tv_nsec -= 1000000000 ;
+  }
+  while (m_sendstatus == Status::waiting){
+    if (sem_timedwait(&m_tx_done, &deadline) != 0 && errno != EINTR) break ;
+  }
+#endif
+  return end_frame() ;
+}
+
+bool RF24Driver::start_send(const uint8_t *receiver, uint8_t *data, uint8_t len)
+{
+  // Held until finish_send
+  if (!lock_send()) return false ;
+  if (!start_frame(receiver, data, len, ++m_tx_sequence)){
+    unlock_send() ;
+    return false ;
+  }
+  return true ;
+}
+
+bool RF24Driver::send_pending()
+{
+  return m_sendstatus == Status::waiting ;
+}
+
+bool RF24Driver::finish_send()
+{
+  bool ret = end_frame() ;
+  unlock_send() ;
+  return ret ;
+}
+
+bool RF24Driver::end_frame()
+{
+  // Still waiting after too long. Set ioerr (TO DO: expose this error)
+  if (m_sendstatus == Status::waiting) m_sendstatus = Status::ioerr ;
+  
+  listen_mode();
+
+  return m_sendstatus == Status::delivered ;
+}
+
+bool RF24Driver::start_frame(const uint8_t *receiver, uint8_t *data, uint8_t len, uint8_t sequence)
 {
   uint8_t send_buff[MAX_RXTXBUF] ;
   if (get_payload_width() < len) return false ; // too long
   send_mode() ;
   
-#ifndef ARDUINO
-  pthread_mutex_lock(&m_rwlock) ;
-#endif
+  lock() ;
+  touch_pipe(find_pipe(receiver)) ;
   
   if (!set_tx_address(receiver, m_address_len)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false ;
   }
 
   if (!set_rx_address(0, receiver, m_address_len)){
-#ifndef ARDUINO
-    pthread_mutex_unlock(&m_rwlock) ;
-#endif
+    unlock() ;
     return false ;
   }
-#ifndef ARDUINO
-  pthread_mutex_unlock(&m_rwlock) ;
-#endif
+  unlock() ;
 
   // Copy address
   memcpy(send_buff, m_device, m_address_len) ;
+  if (m_sequence) send_buff[m_address_len] = sequence ;
   // Copy data
   if (data != NULL && len > 0)
-    memcpy(send_buff+m_address_len, data, len) ;
+    memcpy(send_buff+header_len(), data, len) ;
+
+  // Remainder of the TX settle after the address writes
+  wait_settled() ;
 
   m_sendstatus = Status::waiting ;
   // No flushing of TX buffer required prior to write
+  lock() ;
   write_packet(send_buff) ;
+  unlock() ;
+  return true ;
+}
 
-  // Wait for send status to update or quit after 250 ms
-  for (uint16_t i=0;m_sendstatus == Status::waiting && i < 2500; i++){
-    m_pTimer->microSleep(100) ;
+void RF24Driver::set_pipe_callback(bool (*fn)(void *context, uint8_t *sender, uint8_t *data, uint8_t pipe))
+{
+  m_pipe_callbackfn = fn ;
+}
+
+void RF24Driver::touch_pipe(uint8_t pipe)
+{
+  if (pipe < RF24_PEER_PIPE_FIRST || pipe >= RF24_PIPES) return ;
+  m_peer_pipes[pipe - RF24_PEER_PIPE_FIRST].last_used = ++m_pipe_clock ;
+}
+
+uint8_t RF24Driver::find_pipe(const uint8_t *peer)
+{
+  for (uint8_t i=0; i < RF24_PEER_PIPES; i++){
+    if (m_peer_pipes[i].allocated &&
+	memcmp(m_peer_pipes[i].peer, peer, m_address_len) == 0)
+      return i + RF24_PEER_PIPE_FIRST ;
   }
-  // loop exited after waiting too long. Set ioerr (TO DO: expose this error)
-  if (m_sendstatus == Status::waiting) m_sendstatus = Status::ioerr ;
-  
-  listen_mode();
+  return RF24_PIPE_EMPTY ;
+}
 
-  return m_sendstatus == Status::delivered ;
+const uint8_t *RF24Driver::pipe_peer(uint8_t pipe)
+{
+  if (pipe < RF24_PEER_PIPE_FIRST || pipe >= RF24_PIPES) return NULL ;
+  PeerPipe *p = &m_peer_pipes[pipe - RF24_PEER_PIPE_FIRST] ;
+  return p->allocated?p->peer:NULL ;
+}
+
+uint8_t RF24Driver::next_low_byte()
+{
+  // Rotate through low bytes so an evicted peer's address isn't reused
+  // straight away and its frames are dropped by the radio
+  for (;;){
+    uint8_t low = m_next_low_byte++ ;
+    bool used = (low == m_device[0]) ;
+    for (uint8_t i=0; i < RF24_PEER_PIPES && !used; i++)
+      used = m_peer_pipes[i].allocated && m_peer_pipes[i].low_byte == low ;
+    if (!used) return low ;
+  }
+}
+
+uint8_t RF24Driver::allocate_pipe(const uint8_t *peer, bool ack, uint8_t width, uint8_t *address)
+{
+  uint8_t pipe = RF24_PIPE_EMPTY ;
+  if (!peer || !address) return RF24_PIPE_EMPTY ;
+  if (width == 0) width = get_payload_width() ;
+  if (width > MAX_RXTXBUF - header_len()) return RF24_PIPE_EMPTY ;
+
+  lock() ;
+  pipe = find_pipe(peer) ;
+  if (pipe != RF24_PIPE_EMPTY){
+    // Already allocated
+    touch_pipe(pipe) ;
+    memcpy(address, m_device, m_address_len) ;
+    address[0] = m_peer_pipes[pipe - RF24_PEER_PIPE_FIRST].low_byte ;
+    unlock() ;
+    return pipe ;
+  }
+  // Free pipe or the least recently used
+  uint8_t slot = 0 ;
+  for (uint8_t i=0; i < RF24_PEER_PIPES; i++){
+    if (!m_peer_pipes[i].allocated){
+      slot = i ;
+      break ;
+    }
+    if (m_peer_pipes[i].last_used < m_peer_pipes[slot].last_used) slot = i ;
+  }
+  PeerPipe *p = &m_peer_pipes[slot] ;
+  pipe = slot + RF24_PEER_PIPE_FIRST ;
+  p->allocated = false ;
+  p->low_byte = next_low_byte() ;
+  memcpy(address, m_device, m_address_len) ;
+  address[0] = p->low_byte ;
+
+  // Pipes 2 to 5 only hold the low byte. The rest comes from pipe 1
+  if (!NordicRF24::set_payload_width(pipe, width + header_len()) ||
+      !set_rx_address(pipe, address, 1)){
+    unlock() ;
+    return RF24_PIPE_EMPTY ;
+  }
+  set_pipe_ack(pipe, ack) ;
+  enable_pipe(pipe, true) ;
+  memcpy(p->peer, peer, m_address_len) ;
+  p->allocated = true ;
+  p->last_used = ++m_pipe_clock ;
+  unlock() ;
+  return pipe ;
+}
+
+bool RF24Driver::release_pipe(const uint8_t *peer)
+{
+  lock() ;
+  uint8_t pipe = find_pipe(peer) ;
+  if (pipe == RF24_PIPE_EMPTY){
+    unlock() ;
+    return false ;
+  }
+  enable_pipe(pipe, false) ;
+  m_peer_pipes[pipe - RF24_PEER_PIPE_FIRST].allocated = false ;
+  unlock() ;
+  return true ;
+}
+
+uint8_t RF24Driver::handler_hash(const uint8_t *key, uint8_t len)
+{
+  // FNV-1a with the length mixed in so prefixes of an address hash apart
+  uint32_t h = 2166136261u ^ len ;
+  for (uint8_t i=0; i < len; i++){
+    h ^= key[i] ;
+    h *= 16777619u ;
+  }
+  return (uint8_t)(h ^ (h >> 8) ^ (h >> 16)) ;
+}
+
+uint8_t RF24Driver::handler_slot(const uint8_t *key, uint8_t len, bool insert)
+{
+  uint8_t slot = handler_hash(key, len) & (RF24_HANDLER_SLOTS - 1) ;
+  uint8_t free_slot = RF24_HANDLER_SLOTS ;
+  for (uint8_t i=0; i < RF24_HANDLER_SLOTS; i++){
+    PeerHandler *h = &m_handlers[slot] ;
+    if (h->len == 0){
+      if (h->deleted){
+	if (free_slot == RF24_HANDLER_SLOTS) free_slot = slot ;
+      }else break ; // end of the probe
+    }else if (h->len == len && memcmp(h->key, key, len) == 0)
+      return slot ;
+    slot = (slot + 1) & (RF24_HANDLER_SLOTS - 1) ;
+  }
+  if (!insert) return RF24_HANDLER_SLOTS ;
+  if (free_slot == RF24_HANDLER_SLOTS && m_handlers[slot].len == 0) free_slot = slot ;
+  return free_slot ;
+}
+
+RF24Driver::PeerHandler *RF24Driver::find_handler(const uint8_t *sender)
+{
+  if (m_handler_count == 0) return NULL ;
+  // At most one probe per handler length in use
+  for (uint8_t len=m_address_len; len > 0; len--){
+    if (!(m_handler_lengths & (1 << len))) continue ;
+    uint8_t slot = handler_slot(sender + m_address_len - len, len, false) ;
+    if (slot < RF24_HANDLER_SLOTS) return &m_handlers[slot] ;
+  }
+  return NULL ;
+}
+
+bool RF24Driver::set_peer_handler(const uint8_t *address, uint8_t len,
+				  bool (*fn)(void *context, uint8_t *sender, uint8_t *data),
+				  void *context)
+{
+  if (!address || !fn) return false ;
+  if (len == 0) len = m_address_len ;
+  if (len > m_address_len) return false ;
+  const uint8_t *key = address + m_address_len - len ;
+
+  lock() ;
+  uint8_t slot = handler_slot(key, len, false) ;
+  if (slot == RF24_HANDLER_SLOTS){
+    if (m_handler_count >= RF24_HANDLER_MAX){
+      unlock() ;
+      return false ;
+    }
+    slot = handler_slot(key, len, true) ;
+    memcpy(m_handlers[slot].key, key, len) ;
+    m_handlers[slot].len = len ;
+    m_handlers[slot].deleted = false ;
+    m_handler_count++ ;
+  }
+  m_handlers[slot].fn = fn ;
+  m_handlers[slot].context = context ;
+  m_handler_lengths |= (1 << len) ;
+  unlock() ;
+  return true ;
+}
+
+bool RF24Driver::clear_peer_handler(const uint8_t *address, uint8_t len)
+{
+  if (!address) return false ;
+  if (len == 0) len = m_address_len ;
+  if (len > m_address_len) return false ;
+
+  lock() ;
+  uint8_t slot = handler_slot(address + m_address_len - len, len, false) ;
+  if (slot == RF24_HANDLER_SLOTS){
+    unlock() ;
+    return false ;
+  }
+  m_handlers[slot].len = 0 ;
+  m_handlers[slot].deleted = true ;
+  m_handlers[slot].fn = NULL ;
+  m_handler_count-- ;
+  // Drop the length from the lookup if no other handler uses it
+  bool used = false ;
+  for (uint8_t i=0; i < RF24_HANDLER_SLOTS && !used; i++)
+    used = m_handlers[i].len == len ;
+  if (!used) m_handler_lengths &= ~(1 << len) ;
+  unlock() ;
+  return true ;
+}
+
+bool RF24Driver::is_duplicate(const uint8_t *sender, uint8_t sequence)
+{
+  SeqWindow *w = NULL ;
+  for (uint8_t i=0; i < RF24_DEDUP_PEERS; i++){
+    if (m_seq_windows[i].valid &&
+	memcmp(m_seq_windows[i].peer, sender, m_address_len) == 0){
+      w = &m_seq_windows[i] ;
+      break ;
+    }
+  }
+  if (!w){
+    // New sender takes a free window or the least recently used
+    w = &m_seq_windows[0] ;
+    for (uint8_t i=0; i < RF24_DEDUP_PEERS; i++){
+      if (!m_seq_windows[i].valid){
+	w = &m_seq_windows[i] ;
+	break ;
+      }
+      if (m_seq_windows[i].last_used < w->last_used) w = &m_seq_windows[i] ;
+    }
+    memcpy(w->peer, sender, m_address_len) ;
+    w->valid = true ;
+    w->highest = sequence ;
+    w->seen = 1 ;
+    w->last_used = ++m_seq_clock ;
+    return false ;
+  }
+  w->last_used = ++m_seq_clock ;
+
+  // Distance from the newest number allowing for wrap around
+  int8_t diff = (int8_t)(sequence - w->highest) ;
+  if (diff > 0){
+    w->seen = (diff >= RF24_DEDUP_WINDOW)?1:((w->seen << diff) | 1) ;
+    w->highest = sequence ;
+    return false ;
+  }
+  uint8_t back = -diff ;
+  if (back >= RF24_DEDUP_WINDOW){
+    // Too old for the window. Most likely the sender restarted
+    w->highest = sequence ;
+    w->seen = 1 ;
+    return false ;
+  }
+  if (w->seen & ((uint32_t)1 << back)) return true ;
+  w->seen |= ((uint32_t)1 << back) ;
+  return false ;
+}
+
+#ifndef ARDUINO
+bool RF24Driver::enable_events()
+{
+  return m_tx_event.open() && m_rx_event.open() ;
+}
+
+uint8_t RF24Driver::receive(uint8_t *sender, uint8_t *data, uint8_t *pipe)
+{
+  RxFrame frame ;
+  if (!m_rx_queue.pop(frame)) return 0 ;
+  uint8_t len = frame.size > frame.header?frame.size - frame.header:0 ;
+  if (len > sizeof(frame.packet) - frame.header) len = sizeof(frame.packet) - frame.header ;
+  if (sender) memcpy(sender, frame.packet, m_address_len) ;
+  if (data) memcpy(data, frame.packet + frame.header, len) ;
+  if (pipe) *pipe = frame.pipe ;
+  return len ;
+}
+
+void *RF24Driver::dispatch_thread(void *p)
+{
+  DispatchWorker *w = (DispatchWorker *)p ;
+  RxFrame frame ;
+  for (;;){
+    sem_wait(&w->ready) ;
+    // Frames queued before stopping are still delivered. A wake up with
+    // nothing queued is left over from a dropped frame
+    if (w->queue.pop(frame)){
+      sem_post(&w->space) ;
+      deliver(frame) ;
+    }else if (!w->driver->m_dispatch_running.load(std::memory_order_acquire)) break ;
+  }
+  return NULL ;
+}
+
+bool RF24Driver::dispatch(RxFrame &frame)
+{
+  uint8_t workers = m_worker_count.load(std::memory_order_acquire) ;
+  DispatchWorker *w = &m_workers[handler_hash(frame.packet, m_address_len) % workers] ;
+  while (!w->queue.push(frame)){
+    if (m_overflow == drop_oldest){
+      RxFrame old ;
+      if (w->queue.pop(old)) m_dispatch_drops.fetch_add(1, std::memory_order_relaxed) ;
+    }else if (m_overflow == block && m_dispatch_running.load(std::memory_order_acquire)){
+      // Clear posts for frames taken earlier, which the next push sees,
+      // then wait for the worker to take another
+      while (sem_trywait(&w->space) == 0) ;
+      if (w->queue.push(frame)) break ;
+      sem_wait(&w->space) ;
+    }else{
+      m_dispatch_drops.fetch_add(1, std::memory_order_relaxed) ;
+      return false ;
+    }
+  }
+  sem_post(&w->ready) ;
+  return true ;
+}
+
+bool RF24Driver::start_dispatch(uint8_t workers, DispatchOverflow overflow)
+{
+  if (workers == 0 || workers > RF24_DISPATCH_WORKERS) return false ;
+  if (m_worker_count.load() > 0) return false ; // already running
+  if (!m_workers) m_workers = new DispatchWorker[RF24_DISPATCH_WORKERS] ;
+  m_overflow = overflow ;
+  m_dispatch_running.store(true) ;
+  for (uint8_t i=0; i < workers; i++){
+    DispatchWorker *w = &m_workers[i] ;
+    RxFrame frame ;
+    // Discard frames left from an earlier run
+    while (w->queue.pop(frame)) ;
+    w->driver = this ;
+    sem_init(&w->ready, 0, 0) ;
+    sem_init(&w->space, 0, 0) ;
+    if (pthread_create(&w->thread, NULL, dispatch_thread, w) != 0){
+      EPRINT("Cannot start dispatch worker %d\n", i) ;
+      m_dispatch_running.store(false) ;
+      sem_destroy(&w->ready) ;
+      sem_destroy(&w->space) ;
+      while (i-- > 0){
+	sem_post(&m_workers[i].ready) ;
+	pthread_join(m_workers[i].thread, NULL) ;
+	sem_destroy(&m_workers[i].ready) ;
+	sem_destroy(&m_workers[i].space) ;
+      }
+      return false ;
+    }
+  }
+  m_worker_count.store(workers, std::memory_order_release) ;
+  return true ;
+}
+
+void RF24Driver::stop_dispatch()
+{
+  uint8_t workers = m_worker_count.exchange(0) ;
+  if (workers == 0) return ;
+  m_dispatch_running.store(false) ;
+  for (uint8_t i=0; i < workers; i++){
+    sem_post(&m_workers[i].ready) ;
+    sem_post(&m_workers[i].space) ; // release a blocked dispatch
+    pthread_join(m_workers[i].thread, NULL) ;
+    sem_destroy(&m_workers[i].ready) ;
+    sem_destroy(&m_workers[i].space) ;
+  }
+}
+
+bool RF24Driver::start_tx_queue(TxSchedule schedule)
+{
+  if (m_tx_running.load()) return false ;
+  if (!m_tx_classes){
+    m_tx_classes = new TxClass[RF24_TX_CLASSES] ;
+    for (uint8_t i=0; i < RF24_TX_CLASSES; i++){
+      m_tx_classes[i].weight = 1 ;
+      memset(&m_tx_classes[i].stats, 0, sizeof(RF24TxClassStats)) ;
+    }
+  }
+  if (!m_tx_peers){
+    m_tx_peers = new TxPeer[RF24_TX_PEERS] ;
+    memset(m_tx_peers, 0, sizeof(TxPeer) * RF24_TX_PEERS) ;
+  }
+  update_airtime() ;
+  m_tx_schedule = schedule ;
+  m_tx_turn = 0 ;
+  m_tx_credit = m_tx_classes[0].weight ;
+  sem_init(&m_tx_ready, 0, 0) ;
+  m_tx_running.store(true) ;
+  if (pthread_create(&m_tx_thread, NULL, tx_thread, this) != 0){
+    EPRINT("Cannot start TX thread\n") ;
+    m_tx_running.store(false) ;
+    sem_destroy(&m_tx_ready) ;
+    return false ;
+  }
+  return true ;
+}
+
+void RF24Driver::stop_tx_queue()
+{
+  bool running = true ;
+  if (!m_tx_running.compare_exchange_strong(running, false)) return ;
+  sem_post(&m_tx_ready) ;
+  pthread_join(m_tx_thread, NULL) ;
+  sem_destroy(&m_tx_ready) ;
+}
+
+bool RF24Driver::set_tx_weight(uint8_t tx_class, uint8_t weight)
+{
+  if (tx_class >= RF24_TX_CLASSES || weight == 0 || !m_tx_classes) return false ;
+  m_tx_classes[tx_class].weight = weight ;
+  return true ;
+}
+
+void RF24Driver::set_tx_callback(void (*fn)(void *context, const uint8_t *receiver, bool delivered))
+{
+  m_tx_callbackfn = fn ;
+}
+
+bool RF24Driver::queue_send(uint8_t tx_class, const uint8_t *receiver, const uint8_t *data, uint8_t len)
+{
+  TxFrame frame ;
+  if (tx_class >= RF24_TX_CLASSES || !m_tx_running.load(std::memory_order_acquire)) return false ;
+  if (len > get_payload_width()) return false ; // too long
+  TxClass *c = &m_tx_classes[tx_class] ;
+  memcpy(frame.receiver, receiver, m_address_len) ;
+  if (data && len > 0) memcpy(frame.data, data, len) ;
+  frame.len = len ;
+  frame.tx_class = tx_class ;
+  frame.queued_us = rf24_micros() ;
+  if (!c->queue.push(frame)){
+    pthread_mutex_lock(&m_tx_statlock) ;
+    c->stats.dropped++ ;
+    pthread_mutex_unlock(&m_tx_statlock) ;
+    return false ;
+  }
+  pthread_mutex_lock(&m_tx_statlock) ;
+  uint32_t depth = c->queue.depth() ;
+  if (depth > c->stats.max_depth) c->stats.max_depth = depth ;
+  pthread_mutex_unlock(&m_tx_statlock) ;
+  sem_post(&m_tx_ready) ;
+  return true ;
+}
+
+bool RF24Driver::get_tx_stats(uint8_t tx_class, RF24TxClassStats &stats)
+{
+  if (tx_class >= RF24_TX_CLASSES || !m_tx_classes) return false ;
+  pthread_mutex_lock(&m_tx_statlock) ;
+  stats = m_tx_classes[tx_class].stats ;
+  pthread_mutex_unlock(&m_tx_statlock) ;
+  stats.depth = m_tx_classes[tx_class].queue.depth() ;
+  return true ;
+}
+
+uint8_t RF24Driver::next_tx_class()
+{
+  if (m_tx_schedule == tx_strict){
+    for (uint8_t i=0; i < RF24_TX_CLASSES; i++)
+      if (m_tx_classes[i].queue.depth() > 0) return i ;
+    return RF24_TX_CLASSES ;
+  }
+  // Weighted round robin. An empty class gives up the rest of its turn
+  for (uint8_t i=0; i <= RF24_TX_CLASSES; i++){
+    if (m_tx_credit > 0 && m_tx_classes[m_tx_turn].queue.depth() > 0){
+      m_tx_credit-- ;
+      return m_tx_turn ;
+    }
+    m_tx_turn = (m_tx_turn + 1) % RF24_TX_CLASSES ;
+    m_tx_credit = m_tx_classes[m_tx_turn].weight ;
+  }
+  return RF24_TX_CLASSES ;
+}
+
+void RF24Driver::set_airtime_limit(uint32_t rate_us, uint32_t burst_us)
+{
+  m_tx_burst_us.store(burst_us) ;
+  m_tx_rate_us.store(rate_us) ;
+}
+
+bool RF24Driver::get_tx_peer_stats(uint8_t index, RF24TxPeerStats &stats)
+{
+  bool used = false ;
+  if (index >= RF24_TX_PEERS || !m_tx_peers) return false ;
+  pthread_mutex_lock(&m_tx_statlock) ;
+  used = m_tx_peers[index].used ;
+  stats = m_tx_peers[index].stats ;
+  pthread_mutex_unlock(&m_tx_statlock) ;
+  return used ;
+}
+
+void RF24Driver::update_airtime()
+{
+  uint32_t kbps = 1000 ;
+  uint16_t bits = 0 ;
+  lock() ;
+  switch(get_data_rate()){
+  case RF24_250KBPS:
+    kbps = 250 ;
+    break ;
+  case RF24_2MBPS:
+    kbps = 2000 ;
+    bits += 8 ; // 2 byte preamble
+    break ;
+  }
+  // Preamble, address, 9 bit packet control field, payload and CRC
+  bits += 8 + m_address_len * 8 + 9 + (m_payload_width + m_address_len) * 8 ;
+  if (is_crc_enabled()) bits += is_2_byte_crc()?16:8 ;
+  int8_t delay = get_retry_delay() ;
+  unlock() ;
+  // TX settle then the frame on air
+  m_tx_frame_us = RF24_SETTLE_US + (bits * 1000) / kbps ;
+  m_tx_ard_us = delay < 0?0:(delay + 1) * 250 ;
+}
+
+RF24Driver::TxPeer *RF24Driver::find_tx_peer(const uint8_t *address)
+{
+  TxPeer *slot = NULL ;
+  for (uint8_t i=0; i < RF24_TX_PEERS; i++){
+    TxPeer *p = &m_tx_peers[i] ;
+    if (p->used && memcmp(p->stats.address, address, m_address_len) == 0){
+      p->last_used = ++m_tx_peer_clock ;
+      return p ;
+    }
+    // Free slot or the least recently used which isn't holding frames
+    if (!p->used){
+      if (!slot || slot->used) slot = p ;
+    }else if (p->held_count == 0 && (!slot || (slot->used && p->last_used < slot->last_used)))
+      slot = p ;
+  }
+  if (!slot) return NULL ;
+  pthread_mutex_lock(&m_tx_statlock) ;
+  memset(&slot->stats, 0, sizeof(RF24TxPeerStats)) ;
+  memcpy(slot->stats.address, address, m_address_len) ;
+  slot->used = true ;
+  pthread_mutex_unlock(&m_tx_statlock) ;
+  slot->last_used = ++m_tx_peer_clock ;
+  slot->tokens = m_tx_burst_us.load() ;
+  slot->refill_us = rf24_micros() ;
+  slot->held_first = 0 ;
+  slot->held_count = 0 ;
+  return slot ;
+}
+
+void RF24Driver::refill_tx_peer(TxPeer *peer, uint32_t now)
+{
+  uint32_t rate = m_tx_rate_us.load(), burst = m_tx_burst_us.load() ;
+  uint32_t elapsed = now - peer->refill_us ;
+  peer->refill_us = now ;
+  peer->tokens += ((int64_t)elapsed * rate) / 1000000 ;
+  if (peer->tokens > (int64_t)burst) peer->tokens = burst ;
+}
+
+bool RF24Driver::take_held(TxFrame &frame, TxPeer *&peer, uint32_t &wait_us, bool stopping)
+{
+  uint32_t now = rf24_micros(), rate = m_tx_rate_us.load() ;
+  wait_us = 0 ;
+  if (m_tx_held == 0) return false ;
+  for (uint8_t i=1; i <= RF24_TX_PEERS; i++){
+    uint8_t index = (m_tx_rr + i) % RF24_TX_PEERS ;
+    TxPeer *p = &m_tx_peers[index] ;
+    if (p->held_count == 0) continue ;
+    refill_tx_peer(p, now) ;
+    if (stopping || rate == 0 || p->tokens > 0){
+      frame = p->held[p->held_first] ;
+      p->held_first = (p->held_first + 1) % RF24_TX_HELD ;
+      p->held_count-- ;
+      m_tx_held-- ;
+      m_tx_rr = index ;
+      peer = p ;
+      return true ;
+    }
+    // Time until this destination is out of debt
+    uint32_t us = (uint32_t)((-p->tokens * 1000000) / rate) + 1 ;
+    if (wait_us == 0 || us < wait_us) wait_us = us ;
+  }
+  return false ;
+}
 
+void RF24Driver::charge_airtime(TxPeer *peer)
+{
+  uint8_t lost = 0, retransmitted = 0 ;
+  lock() ;
+  read_observe(lost, retransmitted) ;
+  unlock() ;
+  uint32_t airtime = (retransmitted + 1) * m_tx_frame_us + retransmitted * m_tx_ard_us ;
+  if (m_tx_rate_us.load() > 0) peer->tokens -= airtime ;
+  pthread_mutex_lock(&m_tx_statlock) ;
+  peer->stats.airtime_us += airtime ;
+  peer->stats.frames++ ;
+  peer->stats.retransmits += retransmitted ;
+  pthread_mutex_unlock(&m_tx_statlock) ;
 }
+
+void *RF24Driver::tx_thread(void *p)
+{
+  RF24Driver *driver = (RF24Driver *)p ;
+  TxFrame frame ;
+  for (;;){
+    TxPeer *peer = NULL ;
+    uint32_t wait_us = 0 ;
+    bool running = driver->m_tx_running.load(std::memory_order_acquire) ;
+    if (!driver->take_held(frame, peer, wait_us, !running)){
+      // Each queued frame and the stop have a post
+      if (!running){
+	if (sem_trywait(&driver->m_tx_ready) != 0) break ;
+      }else if (wait_us > 0){
+	// Wake when a held destination has airtime again
+	struct timespec deadline ;
+	clock_gettime(CLOCK_REALTIME, &deadline) ;
+	deadline.tv_sec += wait_us / 1000000 ;
+	deadline.tv_nsec += (wait_us % 1000000) * 1000 ;
+	if (deadline.tv_nsec >= 1000000000){
+	  deadline.tv_sec++ ;
+	  deadline.tv_nsec -= 1000000000 ;
+	}
+	if (sem_timedwait(&driver->m_tx_ready, &deadline) != 0) continue ;
+      }else sem_wait(&driver->m_tx_ready) ;
+
+      // Frames queued before stopping are still sent
+      uint8_t tx_class = driver->next_tx_class() ;
+      if (tx_class == RF24_TX_CLASSES) continue ;
+      if (!driver->m_tx_classes[tx_class].queue.pop(frame)) continue ;
+
+      peer = driver->find_tx_peer(frame.receiver) ;
+      if (peer && driver->m_tx_rate_us.load() > 0){
+	driver->refill_tx_peer(peer, rf24_micros()) ;
+	// Keep behind frames already held for the destination
+	if (peer->held_count > 0 || peer->tokens <= 0){
+	  if (peer->held_count < RF24_TX_HELD){
+	    peer->held[(peer->held_first + peer->held_count) % RF24_TX_HELD] = frame ;
+	    peer->held_count++ ;
+	    driver->m_tx_held++ ;
+	    pthread_mutex_lock(&driver->m_tx_statlock) ;
+	    peer->stats.deferred++ ;
+	    pthread_mutex_unlock(&driver->m_tx_statlock) ;
+	    continue ;
+	  }
+	  pthread_mutex_lock(&driver->m_tx_statlock) ;
+	  peer->stats.dropped++ ;
+	  driver->m_tx_classes[frame.tx_class].stats.dropped++ ;
+	  pthread_mutex_unlock(&driver->m_tx_statlock) ;
+	  if (driver->m_tx_callbackfn)
+	    (*driver->m_tx_callbackfn)(driver->m_callbackcontext, frame.receiver, false) ;
+	  continue ;
+	}
+      }
+    }
+    uint32_t wait = rf24_micros() - frame.queued_us ;
+    bool delivered = false ;
+    if (driver->lock_send()){
+      delivered = driver->send_frame(frame.receiver, frame.data, frame.len, ++driver->m_tx_sequence) ;
+      // Read OBSERVE_TX before another send can start
+      if (peer) driver->charge_airtime(peer) ;
+      driver->unlock_send() ;
+    }
+
+    TxClass *c = &driver->m_tx_classes[frame.tx_class] ;
+    pthread_mutex_lock(&driver->m_tx_statlock) ;
+    c->stats.wait_us += wait ;
+    if (wait > c->stats.wait_max_us) c->stats.wait_max_us = wait ;
+    if (delivered) c->stats.sent++ ;
+    else c->stats.failed++ ;
+    pthread_mutex_unlock(&driver->m_tx_statlock) ;
+
+    if (driver->m_tx_callbackfn)
+      (*driver->m_tx_callbackfn)(driver->m_callbackcontext, frame.receiver, delivered) ;
+  }
+  return NULL ;
+}
+#endif
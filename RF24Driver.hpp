@@ -1,5 +1,10 @@
 #include "PacketDriver.hpp"
 #include "rpinrf24.hpp"
+#ifndef ARDUINO
+ #include "rf24queue.hpp"
+ #include "rf24event.hpp"
+ #include <semaphore.h>
+#endif
 
 #ifndef __MQTTSN_RF24_DRIVER
 #define __MQTTSN_RF24_DRIVER
@@ -15,30 +20,383 @@
 #endif
 #define PACKET_DRIVER_MAX_PAYLOAD (MAX_RXTXBUF - MIN_RF24_ADDRESS_LEN)
 
+// Pipes 2 to 5 can be given to individual peers
+#define RF24_PEER_PIPE_FIRST 2
+#define RF24_PEER_PIPES 4
+
+// Slots in the sender handler table. Must be a power of 2. The table is
+// kept at most 3/4 full so a lookup finds a free slot quickly. Define
+// before including this header to change the size
+#ifndef RF24_HANDLER_SLOTS
+#ifdef ARDUINO
+#define RF24_HANDLER_SLOTS 4
+#else
+#define RF24_HANDLER_SLOTS 16
+#endif
+#endif
+#define RF24_HANDLER_MAX ((RF24_HANDLER_SLOTS * 3) / 4)
+
+// Senders tracked for duplicate frames and the number of sequence
+// numbers remembered behind the newest from each sender (max 32).
+// Define before including this header to change them
+#ifndef RF24_DEDUP_PEERS
+#ifdef ARDUINO
+#define RF24_DEDUP_PEERS 2
+#else
+#define RF24_DEDUP_PEERS 8
+#endif
+#endif
+#ifndef RF24_DEDUP_WINDOW
+#define RF24_DEDUP_WINDOW 32
+#endif
+
+// Frames held in the RX FIFO
+#define RF24_RX_FIFO 3
+
+// Callback worker threads and the frames each can queue (power of 2)
+#define RF24_DISPATCH_WORKERS 8
+#define RF24_DISPATCH_DEPTH 32
+
+// Frames held for receive when event descriptors are used (power of 2)
+#define RF24_RX_QUEUE_DEPTH 32
+
+// Priority classes for queued sends, class 0 first, and the frames each
+// class can queue (power of 2)
+#define RF24_TX_CLASSES 4
+#define RF24_TX_DEPTH 16
+
+// Destinations tracked for airtime and the frames each can hold back
+// while over its airtime limit
+#define RF24_TX_PEERS 16
+#define RF24_TX_HELD 4
+
+// Counters for a TX priority class
+struct RF24TxClassStats{
+  uint32_t depth ; // frames queued now
+  uint32_t max_depth ;
+  uint32_t sent ; // delivered
+  uint32_t failed ; // max retries or timed out
+  uint32_t dropped ; // queue full
+  uint64_t wait_us ; // total time from queue_send to the start of sending
+  uint32_t wait_max_us ;
+};
+
+// Airtime used sending to a destination
+struct RF24TxPeerStats{
+  uint8_t address[MAX_RF24_ADDRESS_LEN] ;
+  uint64_t airtime_us ; // including retransmits
+  uint32_t frames ;
+  uint32_t retransmits ; // from OBSERVE_TX
+  uint32_t deferred ; // held back while over the limit
+  uint32_t dropped ; // over the limit with no room to hold
+};
+
 class RF24Driver : public IPacketDriver, public NordicRF24{
 public:
   RF24Driver();
+  ~RF24Driver();
 
   // Set device address, broadcast address and required address length
   // Once length has been set the it cannot be changed
-  bool initialise(uint8_t *device, uint8_t *broadcast, uint8_t length);
+  bool initialise(uint8_t *device, uint8_t *broadcast, uint8_t length) override ;
+  // Call before initialise. A warm start skips the reset and keeps a radio
+  // which is already powered up. Only registers which differ from the
+  // configuration are written
+  void set_warm_start(bool warm) ;
   bool shutdown();
   virtual bool data_received_interrupt();
   virtual bool max_retry_interrupt() ;
   virtual bool data_sent_interrupt() ;
 
   bool send(const uint8_t *receiver, uint8_t *data, uint8_t len) ;
+  // Send again with the sequence number of the last send. If the first
+  // frame did arrive the receiver drops this one
+  bool retransmit(const uint8_t *receiver, uint8_t *data, uint8_t len) ;
+  // Send without waiting for the result. send_pending is true until the
+  // frame is delivered or fails. finish_send returns true if delivered
+  // and puts the radio back in listen mode. Calling it while still
+  // pending gives up on the frame.
+  // On Linux one send runs at a time. send, retransmit, start_send and
+  // the TX queue wait for a send on another thread to finish, and
+  // start_send holds the radio until finish_send is called from the same
+  // thread. Sending again on that thread before finish_send fails
+  bool start_send(const uint8_t *receiver, uint8_t *data, uint8_t len) ;
+  bool send_pending() ;
+  bool finish_send() ;
   bool set_payload_width(uint8_t width);
   uint8_t get_payload_width();
   bool send_mode();
   bool listen_mode();
   uint8_t *get_broadcast(){return m_broadcast ;}
   uint8_t *get_address(){return m_device;}
+  uint8_t get_address_len(){return m_address_len;}
+
+  // Add a sequence number byte after the sender address. Frames repeating
+  // a sequence number recently seen from the same sender are dropped
+  // before the callback. All devices must use the same setting.
+  // Takes one byte from the payload width
+  bool set_sequence(bool enable) ;
+  bool get_sequence(){return m_sequence ;}
+  // Frames dropped as duplicates
+  uint32_t get_duplicates(){return m_duplicates ;}
+  // Frames dropped as too short for the address and sequence header,
+  // including failed width reads
+  uint32_t get_short_frames(){return m_short_frames ;}
+
+#ifndef ARDUINO
+  // What to do with a received frame when its worker queue is full.
+  // Blocking holds up the interrupt thread until the worker catches up
+  enum DispatchOverflow{drop_newest, drop_oldest, block} ;
+  // Run callbacks on a pool of worker threads instead of the interrupt
+  // thread. Frames from one sender always go to the same worker so each
+  // sender's frames are handled in order
+  bool start_dispatch(uint8_t workers, DispatchOverflow overflow = drop_newest) ;
+  // Waits for the workers to finish queued frames. Stop receiving with
+  // shutdown first so no frames arrive while stopping
+  void stop_dispatch() ;
+  // Frames discarded by the overflow policy
+  uint32_t get_dispatch_drops(){return m_dispatch_drops.load(std::memory_order_relaxed) ;}
+
+  // Descriptors for epoll or other event loops. Once enabled, frames from
+  // senders without a handler are queued for receive instead of going to
+  // the data received callback. The rx descriptor becomes readable when
+  // frames are queued and the tx descriptor when a send completes or
+  // fails. Read a descriptor to reset it (see RF24Event::clear)
+  bool enable_events() ;
+  int rx_event_fd(){return m_rx_event.fd() ;}
+  int tx_event_fd(){return m_tx_event.fd() ;}
+  // Copy out the next queued frame. sender takes the address and data the
+  // payload. Returns the payload length or 0 if nothing is queued
+  uint8_t receive(uint8_t *sender, uint8_t *data, uint8_t *pipe = NULL) ;
+  // Frames dropped because the receive queue was full
+  uint32_t get_rx_drops(){return m_rx_drops.load(std::memory_order_relaxed) ;}
+
+  // Queued sends in priority classes, sent one frame at a time by a TX
+  // thread. Strict always sends from the highest priority class with
+  // frames waiting. Weighted takes turns, sending up to the class weight
+  // before moving on, so bulk classes still get a share.
+  // A class can only jump ahead between frames
+  enum TxSchedule{tx_strict, tx_weighted} ;
+  bool start_tx_queue(TxSchedule schedule = tx_strict) ;
+  // Frames still queued are sent before the thread stops
+  void stop_tx_queue() ;
+  // Frames sent per turn by weighted scheduling. Defaults to 1
+  bool set_tx_weight(uint8_t tx_class, uint8_t weight) ;
+  // Queue a frame. Returns false if the class is full (counted as dropped)
+  bool queue_send(uint8_t tx_class, const uint8_t *receiver, const uint8_t *data, uint8_t len) ;
+  // Called on the TX thread with the result of each queued frame
+  void set_tx_callback(void (*fn)(void *context, const uint8_t *receiver, bool delivered)) ;
+  bool get_tx_stats(uint8_t tx_class, RF24TxClassStats &stats) ;
+  // Token bucket per destination for queued sends. Each frame is charged
+  // the airtime it used, including retransmits read from OBSERVE_TX.
+  // A destination earns rate_us of airtime per second up to burst_us.
+  // Frames for a destination which is over its limit are held back, up
+  // to RF24_TX_HELD, and other destinations are sent to meanwhile. Held
+  // destinations take turns once they have airtime again.
+  // A rate of 0 removes the limit
+  void set_airtime_limit(uint32_t rate_us, uint32_t burst_us) ;
+  // Airtime stats for destination slots 0 to RF24_TX_PEERS-1. Returns
+  // false if the slot is unused
+  bool get_tx_peer_stats(uint8_t index, RF24TxPeerStats &stats) ;
+#endif
+
+  // Callback which is also given the pipe a frame arrived on. Used in
+  // place of the set_data_received_callback function when set
+  void set_pipe_callback(bool (*fn)(void *context, uint8_t *sender, uint8_t *data, uint8_t pipe)) ;
+
+  // Give a peer its own receive pipe from 2 to 5. The pipe address shares
+  // the device address MSBs with a new low byte and is written to address.
+  // The peer must send to this address. If all pipes are in use the least
+  // recently used peer is evicted. width is the pipe payload width
+  // (0 uses the driver payload width). Returns the pipe, or RF24_PIPE_EMPTY
+  // if it cannot be set up
+  uint8_t allocate_pipe(const uint8_t *peer, bool ack, uint8_t width, uint8_t *address) ;
+  // Disable the pipe held by a peer. Returns false if the peer has no pipe
+  bool release_pipe(const uint8_t *peer) ;
+  // Pipe held by a peer or RF24_PIPE_EMPTY
+  uint8_t find_pipe(const uint8_t *peer) ;
+  // Peer holding a pipe or NULL
+  const uint8_t *pipe_peer(uint8_t pipe) ;
+
+  // Send frames from one sender to their own handler. len is the number of
+  // most significant address bytes to match so a handler can cover every
+  // sender sharing a prefix. A len of 0 matches the whole address. Set after
+  // initialise as the address length is fixed then. The longest match wins.
+  // Senders without a handler use the data received callback.
+  // Returns false if the table is full or len is too long
+  bool set_peer_handler(const uint8_t *address, uint8_t len,
+			bool (*fn)(void *context, uint8_t *sender, uint8_t *data),
+			void *context) ;
+  // Returns false if no handler was set for the address and length
+  bool clear_peer_handler(const uint8_t *address, uint8_t len) ;
 protected:
+  struct PeerHandler{
+    uint8_t key[MAX_RF24_ADDRESS_LEN] ; // address MSBs
+    uint8_t len ; // 0 for a free slot
+    bool deleted ; // cleared slot which doesn't end a probe
+    bool (*fn)(void *, uint8_t *, uint8_t *) ;
+    void *context ;
+  } ;
+  // Open addressing table with linear probing. No allocation when used
+  static_assert(RF24_HANDLER_SLOTS >= 2 && RF24_HANDLER_SLOTS <= 128 &&
+		(RF24_HANDLER_SLOTS & (RF24_HANDLER_SLOTS - 1)) == 0, "Handler slots must be a power of 2 up to 128") ;
+  PeerHandler m_handlers[RF24_HANDLER_SLOTS] ;
+  uint8_t m_handler_count ;
+  uint8_t m_handler_lengths ; // bit n set if a handler matches n bytes
+  static uint8_t handler_hash(const uint8_t *key, uint8_t len) ;
+  // Slot holding key, or the slot to insert it into if insert is true.
+  // Returns RF24_HANDLER_SLOTS if not found
+  uint8_t handler_slot(const uint8_t *key, uint8_t len, bool insert) ;
+  // Longest matching handler for a sender or NULL
+  PeerHandler *find_handler(const uint8_t *sender) ;
+
+  // Sliding window of sequence numbers seen from a sender
+  struct SeqWindow{
+    uint8_t peer[MAX_RF24_ADDRESS_LEN] ;
+    uint8_t highest ; // newest sequence number
+    uint32_t seen ; // bit n set if highest-n has been received
+    uint32_t last_used ;
+    bool valid ;
+  } ;
+  static_assert(RF24_DEDUP_PEERS > 0 && RF24_DEDUP_WINDOW > 0 && RF24_DEDUP_WINDOW <= 32,
+		"Dedup needs a sender and a window of 1 to 32") ;
+  SeqWindow m_seq_windows[RF24_DEDUP_PEERS] ;
+  uint32_t m_seq_clock ;
+  bool m_sequence ;
+  uint8_t m_tx_sequence ; // last sequence number sent
+  RF24Atomic<uint32_t> m_duplicates ;
+  RF24Atomic<uint32_t> m_short_frames ;
+  // Record a sequence number from a sender. Returns true if already seen
+  bool is_duplicate(const uint8_t *sender, uint8_t sequence) ;
+  // Bytes before the payload in a frame
+  uint8_t header_len(){return m_address_len + (m_sequence?1:0) ;}
+  bool send_frame(const uint8_t *receiver, uint8_t *data, uint8_t len, uint8_t sequence) ;
+  // Set addresses and write the frame without waiting
+  bool start_frame(const uint8_t *receiver, uint8_t *data, uint8_t len, uint8_t sequence) ;
+  // Result of the frame and back to listen mode
+  bool end_frame() ;
+  // Held from the start of a send until its result is read. Returns
+  // false if this thread already holds it
+  bool lock_send() ;
+  void unlock_send() ;
+
+  // Frame read from the radio with the callback chosen for it
+  struct RxFrame{
+    bool (*fn)(void *, uint8_t *, uint8_t *) ;
+    bool (*pipefn)(void *, uint8_t *, uint8_t *, uint8_t) ;
+    void *context ;
+    uint8_t pipe ;
+    uint8_t header ; // offset of the data
+    uint8_t size ; // bytes read
+    uint8_t packet[MAX_RXTXBUF] ;
+  } ;
+  static bool deliver(RxFrame &frame) ;
+
+#ifndef ARDUINO
+  struct DispatchWorker{
+    RF24Queue<RxFrame, RF24_DISPATCH_DEPTH> queue ;
+    sem_t ready ; // posted for each frame queued and to stop
+    sem_t space ; // posted for each frame taken and to stop
+    pthread_t thread ;
+    RF24Driver *driver ;
+  } ;
+  static void *dispatch_thread(void *p) ;
+  // Queue a frame for its sender's worker. Returns false if dropped
+  bool dispatch(RxFrame &frame) ;
+  // Allocated by the first start_dispatch and kept until destroyed
+  DispatchWorker *m_workers ;
+  std::atomic<uint8_t> m_worker_count ;
+  std::atomic<bool> m_dispatch_running ;
+  std::atomic<uint32_t> m_dispatch_drops ;
+  DispatchOverflow m_overflow ;
+
+  RF24Event m_rx_event ;
+  RF24Event m_tx_event ;
+  sem_t m_tx_done ; // posted when a send is delivered or fails
+  pthread_mutex_t m_send_lock ; // error checking so misuse fails
+  RF24Queue<RxFrame, RF24_RX_QUEUE_DEPTH> m_rx_queue ;
+  std::atomic<uint32_t> m_rx_drops ;
+
+  struct TxFrame{
+    uint8_t receiver[MAX_RF24_ADDRESS_LEN] ;
+    uint8_t data[MAX_RXTXBUF] ;
+    uint8_t len ;
+    uint8_t tx_class ;
+    uint32_t queued_us ; // rf24_micros when queued
+  } ;
+  struct TxClass{
+    RF24Queue<TxFrame, RF24_TX_DEPTH> queue ;
+    uint8_t weight ;
+    RF24TxClassStats stats ;
+  } ;
+  // Destination state. Only used by the TX thread apart from stats
+  struct TxPeer{
+    bool used ;
+    uint32_t last_used ;
+    int64_t tokens ; // airtime available in us, negative when in debt
+    uint32_t refill_us ; // rf24_micros of the last refill
+    TxFrame held[RF24_TX_HELD] ;
+    uint8_t held_first ;
+    uint8_t held_count ;
+    RF24TxPeerStats stats ;
+  } ;
+  static void *tx_thread(void *p) ;
+  // Class to send from next or RF24_TX_CLASSES if all are empty
+  uint8_t next_tx_class() ;
+  // Destination slot, or NULL if every slot is holding frames
+  TxPeer *find_tx_peer(const uint8_t *address) ;
+  void refill_tx_peer(TxPeer *peer, uint32_t now) ;
+  // Next held frame from a destination with airtime, taking turns between
+  // destinations. Otherwise sets wait_us to the time until one has
+  // airtime. All held frames are ready when stopping
+  bool take_held(TxFrame &frame, TxPeer *&peer, uint32_t &wait_us, bool stopping) ;
+  // Charge the last send to a destination using OBSERVE_TX
+  void charge_airtime(TxPeer *peer) ;
+  // Airtime of one attempt and of the wait between attempts
+  void update_airtime() ;
+  // Allocated by the first start_tx_queue and kept until destroyed
+  TxClass *m_tx_classes ;
+  TxPeer *m_tx_peers ;
+  uint8_t m_tx_rr ; // destination served last from held frames
+  uint16_t m_tx_held ; // frames held over all destinations
+  uint32_t m_tx_peer_clock ;
+  std::atomic<uint32_t> m_tx_rate_us ;
+  std::atomic<uint32_t> m_tx_burst_us ;
+  uint32_t m_tx_frame_us ;
+  uint32_t m_tx_ard_us ;
+  TxSchedule m_tx_schedule ;
+  uint8_t m_tx_turn ; // weighted: class taking its turn
+  uint8_t m_tx_credit ; // weighted: frames left in the turn
+  sem_t m_tx_ready ; // posted for each frame queued and to stop
+  pthread_t m_tx_thread ;
+  std::atomic<bool> m_tx_running ;
+  pthread_mutex_t m_tx_statlock ;
+  void (*m_tx_callbackfn)(void *, const uint8_t *, bool) ;
+#endif
+
+
+
+  struct PeerPipe{
+    uint8_t peer[MAX_RF24_ADDRESS_LEN] ;
+    uint8_t low_byte ; // pipe address LSB
+    uint32_t last_used ; // m_pipe_clock when last sent to or received from
+    bool allocated ;
+  } ;
+  PeerPipe m_peer_pipes[RF24_PEER_PIPES] ;
+  uint32_t m_pipe_clock ;
+  uint8_t m_next_low_byte ;
+  bool m_warm_start ;
+  bool (*m_pipe_callbackfn)(void *, uint8_t *, uint8_t *, uint8_t) ;
+  // Mark a peer pipe as used now
+  void touch_pipe(uint8_t pipe) ;
+  // Low byte not used by pipe 1 or an allocated pipe
+  uint8_t next_low_byte() ;
+
   uint8_t m_device[MAX_RF24_ADDRESS_LEN] ;
   uint8_t m_broadcast[MAX_RF24_ADDRESS_LEN] ;
   uint8_t m_payload_width ;
-  volatile enum Status{waiting, delivered, ioerr, failed} m_sendstatus ;
+  enum Status{waiting, delivered, ioerr, failed} ;
+  RF24Atomic<Status> m_sendstatus ; // set by the interrupt handlers
 private:
   
 };
@@ -1,7 +1,7 @@
 @echo off
 set ARDUINO_EXE_DIR=C:\Program Files (x86)\Arduino
 set HWFILES=arduinohardware.cpp arduinohardware.hpp hardware.cpp hardware.hpp PacketDriver.hpp
-set RF24FILES=RF24Driver.cpp RF24Driver.hpp rpinrf24.cpp rpinrf24.hpp radioutil.cpp radioutil.hpp
+set RF24FILES=RF24Driver.cpp RF24Driver.hpp rpinrf24.cpp rpinrf24.hpp rpinrf24.ipp radioutil.cpp radioutil.hpp rf24time.hpp rf24log.cpp rf24log.hpp rf24registers.hpp rf24bus.hpp rf24spibatch.hpp rf24atomic.hpp
 set HW_DIR=..\..\hardware
 set RF24_DIR=..
 set ARDUINO_DIR=.
@@ -15,17 +15,41 @@
 #ifndef __BUFFERED_NORDIC_RF24
 #define __BUFFERED_NORDIC_RF24
 
-// 50 read and 50 write packets can be held. 
-// Can be scaled for embedded by changing these macros (should be multiple of 32)
+// Default capacities of the BufferedRF24 typedef. Other sizes can be set
+// with BufferedRF24T template parameters (should be a multiple of the payload width)
 #define RF24_BUFFER_READ 64
 #define RF24_BUFFER_WRITE 64
+// Pipes which have a read buffer, bit 0 is pipe 0
+#define RF24_BUFFER_PIPES 0x3F
 
 #include "rpinrf24.hpp"
+#ifndef ARDUINO
+ #include "rf24event.hpp"
+#endif
+
+// Timeout value for blocking calls which wait until data arrives or is sent
+#define RF24_WAIT_FOREVER 0
 
-class BufferedRF24 : public NordicRF24{
+// READ_CAPACITY bytes are buffered for each pipe in PIPE_MASK. Pipes outside
+// the mask have no buffer and their data is dropped. WRITE_CAPACITY bytes are
+// buffered for sending. PAYLOAD_WIDTH is the largest packet used.
+// Member functions are defined in bufferedrf24.ipp
+template <uint16_t READ_CAPACITY = RF24_BUFFER_READ, uint16_t WRITE_CAPACITY = RF24_BUFFER_WRITE,
+	  uint8_t PIPE_MASK = RF24_BUFFER_PIPES, uint8_t PAYLOAD_WIDTH = MAX_RXTXBUF>
+class BufferedRF24T : public NordicRF24{
+  static_assert(PAYLOAD_WIDTH > 0 && PAYLOAD_WIDTH <= MAX_RXTXBUF, "Payload width must be 1 to 32") ;
+  static_assert(PIPE_MASK != 0 && PIPE_MASK <= RF24_BUFFER_PIPES, "Pipe mask must select pipes 0 to 5") ;
+  static_assert(READ_CAPACITY >= PAYLOAD_WIDTH && WRITE_CAPACITY >= PAYLOAD_WIDTH, "Buffers must hold a payload") ;
 public:
-  BufferedRF24();
-  ~BufferedRF24();
+  BufferedRF24T();
+  ~BufferedRF24T();
+
+  // Number of pipes set in a mask
+  static constexpr uint8_t pipe_count(uint8_t mask){return mask?(mask & 1) + pipe_count(mask >> 1):0;}
+  static constexpr bool is_buffered(uint8_t pipe){return pipe < RF24_PIPES && (PIPE_MASK & (1 << pipe));}
+  // Buffer index of a pipe. Unbuffered pipes are skipped
+  static constexpr uint8_t pipe_slot(uint8_t pipe){return pipe_count(PIPE_MASK & ((1 << pipe) - 1));}
+  static const uint8_t buffered_pipes = pipe_count(PIPE_MASK) ;
 
   // Additional orchestration for the RF24 driver to simplify the interface
   // Enable or disable power with correct settling time
@@ -34,32 +58,82 @@ public:
   bool listen_mode(bool bListen) ;
   
   // Writes a buffer of data to a receiver. Returns bytes written.
-  // Cannot exceed RF24_BUFFER_WRITE length
-  // Can throw BuffIOErr or BuffMaxRetry if blocking
-  uint16_t write(uint8_t *buffer, uint16_t length, bool blocking) ;
+  // Cannot exceed WRITE_CAPACITY length
+  // If blocking, waits up to timeout_ms for the data to be sent and returns 0
+  // with a status of max_retry_failure, io_err or timeout if it isn't
+  uint16_t write(uint8_t *buffer, uint16_t length, bool blocking, uint32_t timeout_ms = RF24_WAIT_FOREVER) ;
 
   // Read data into a buffer. Returns bytes written. Returns 0 if no data is waiting and not blocking
-  // Can throw BuffIOErr if blocking
-  uint16_t read(uint8_t *buffer, uint16_t length, uint8_t pipe, bool blocking) ;
+  // If blocking, waits up to timeout_ms for data and returns 0 with a status
+  // of io_err, buff_overflow or timeout if none arrives
+  uint16_t read(uint8_t *buffer, uint16_t length, uint8_t pipe, bool blocking, uint32_t timeout_ms = RF24_WAIT_FOREVER) ;
 
-  enum enStatus {ok,max_retry_failure,io_err,buff_overflow} ;
+  // Stream writes of any length. Whole packets are queued as buffer space
+  // frees up, blocking the caller until the radio has taken the data.
+  // A partial packet is held until more data is written or flush_stream
+  // is called. Returns bytes accepted, which is less than length on
+  // timeout or send failure (see get_status)
+  uint32_t write_stream(const uint8_t *data, uint32_t length, uint32_t timeout_ms = RF24_WAIT_FOREVER) ;
+  // Pad and send any held partial packet and wait for all data to be sent
+  bool flush_stream(uint32_t timeout_ms = RF24_WAIT_FOREVER) ;
+  // Read the byte stream of a pipe. Blocks until at least one byte is available
+  uint16_t read_stream(uint8_t *buffer, uint16_t length, uint8_t pipe, uint32_t timeout_ms = RF24_WAIT_FOREVER) ;
+
+  enum enStatus {ok,max_retry_failure,io_err,buff_overflow,timeout} ;
 
   // Call the write_status if using non-blocking write calls and find out if the
   // read or write was successful. 
   enStatus get_status();
+
+#ifndef ARDUINO
+  // Descriptor for epoll or other event loops. Becomes readable whenever
+  // blocked callers would be woken: data buffered, a send completed or an
+  // error. Read it to reset (see RF24Event::clear) then call the non
+  // blocking read or get_status. Created by the first call, which should
+  // be made before the radio is listening. Returns -1 if it cannot be created
+  int event_fd(){return m_event.open()?m_event.fd():-1 ;}
+#endif
   
 protected:
   virtual bool data_received_interrupt() ;
   virtual bool max_retry_interrupt();
   virtual bool data_sent_interrupt();
 
-  volatile uint8_t m_read_buffer[RF24_PIPES][RF24_BUFFER_READ];
-  volatile uint8_t m_write_buffer[RF24_BUFFER_WRITE];
-  volatile uint16_t m_read_size[RF24_PIPES], m_front_read[RF24_PIPES] ;
-  volatile uint16_t m_write_size, m_front_write ;
+  // Wake any blocked readers and writers. Called by the interrupt handlers
+  void notify() ;
+  // Wait until notify is called after events was read from m_events.
+  // Returns false if timeout_ms has passed since start (rf24_micros)
+  bool wait_event(uint32_t events, uint32_t start, uint32_t timeout_ms) ;
+#ifndef ARDUINO
+  pthread_mutex_t m_waitlock ;
+  pthread_cond_t m_waitcond ;
+  RF24Event m_event ;
+#endif
+  RF24Atomic<uint32_t> m_events ; // count of notify calls
+
+  // Append whole packets to the write buffer and start sending if idle.
+  // Returns bytes queued
+  uint16_t queue_packets(const uint8_t *data, uint16_t length) ;
+  // Queue whole packets, waiting for space. Returns bytes queued
+  uint32_t queue_stream(const uint8_t *data, uint32_t length, uint32_t start, uint32_t timeout_ms) ;
+  uint8_t m_stream_tail[PAYLOAD_WIDTH] ; // partial packet held by write_stream
+  uint8_t m_stream_tail_len ;
+
+  volatile uint8_t m_read_buffer[buffered_pipes][READ_CAPACITY];
+  volatile uint8_t m_write_buffer[WRITE_CAPACITY];
+  // Sizes and status are read by waiting threads without the lock
+  RF24Atomic<uint16_t> m_read_size[buffered_pipes], m_front_read[buffered_pipes] ;
+  RF24Atomic<uint16_t> m_write_size, m_front_write ;
 
-  volatile enStatus m_status ;  
+  RF24Atomic<enStatus> m_status ;
 };
 
+// All pipes with 64 byte buffers
+typedef BufferedRF24T<> BufferedRF24 ;
+
+#include "bufferedrf24.ipp"
+
+// Prebuilt in bufferedrf24.cpp
+extern template class BufferedRF24T<> ;
 
 #endif
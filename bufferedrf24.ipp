@@ -0,0 +1,544 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Member definitions of BufferedRF24T. Included by bufferedrf24.hpp so
+// any configuration can be instantiated
+#ifndef __BUFFERED_NORDIC_RF24_IPP
+#define __BUFFERED_NORDIC_RF24_IPP
+
+#include "rf24log.hpp"
+#include "rf24time.hpp"
+#include <string.h>
+#include <stdio.h>
+
+#define BUFFERED_TEMPLATE template <uint16_t READ_CAPACITY, uint16_t WRITE_CAPACITY, uint8_t PIPE_MASK, uint8_t PAYLOAD_WIDTH>
+#define BUFFERED_CLASS BufferedRF24T<READ_CAPACITY, WRITE_CAPACITY, PIPE_MASK, PAYLOAD_WIDTH>
+
+BUFFERED_TEMPLATE
+BUFFERED_CLASS::BufferedRF24T()
+{
+  for (int i = 0; i < buffered_pipes; i++){
+    m_read_size[i] = 0;  
+    m_front_read[i] = 0 ;
+  }
+  m_write_size = 0;
+  m_front_write = 0 ;
+  m_status = ok ;
+  m_events = 0 ;
+  m_stream_tail_len = 0 ;
+#ifndef ARDUINO
+  pthread_condattr_t attr ;
+  pthread_condattr_init(&attr) ;
+  // Timed waits use the monotonic clock so they survive clock changes
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ;
+  pthread_mutex_init(&m_waitlock, NULL) ;
+  if (pthread_cond_init(&m_waitcond, &attr) != 0){
+    EPRINT("Cannot initialise condition variable\n") ;
+  }
+  pthread_condattr_destroy(&attr) ;
+#endif
+}
+
+BUFFERED_TEMPLATE
+BUFFERED_CLASS::~BufferedRF24T()
+{
+#ifndef ARDUINO
+  pthread_cond_destroy(&m_waitcond) ;
+  pthread_mutex_destroy(&m_waitlock) ;
+#endif
+}
+
+BUFFERED_TEMPLATE
+void BUFFERED_CLASS::notify()
+{
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_waitlock) ;
+  m_events++ ;
+  pthread_cond_broadcast(&m_waitcond) ;
+  pthread_mutex_unlock(&m_waitlock) ;
+  m_event.signal() ;
+#else
+  m_events++ ;
+#endif
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::wait_event(uint32_t events, uint32_t start, uint32_t timeout_ms)
+{
+  uint64_t limit = (uint64_t)timeout_ms * 1000 ;
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_waitlock) ;
+  while (m_events == events){
+    if (timeout_ms == RF24_WAIT_FOREVER){
+      pthread_cond_wait(&m_waitcond, &m_waitlock) ;
+      continue ;
+    }
+    uint32_t elapsed = rf24_micros() - start ;
+    if (elapsed >= limit){
+      pthread_mutex_unlock(&m_waitlock) ;
+      return false ;
+    }
+    uint64_t remaining = limit - elapsed ;
+    struct timespec deadline ;
+    clock_gettime(CLOCK_MONOTONIC, &deadline) ;
+    deadline.tv_sec += remaining / 1000000 ;
+    deadline.tv_nsec += (remaining % 1000000) * 1000 ;
+    if (deadline.tv_nsec >= 1000000000){
+      deadline.tv_sec++ ;
+      deadline.tv_nsec -= 1000000000 ;
+    }
+    pthread_cond_timedwait(&m_waitcond, &m_waitlock, &deadline) ;
+  }
+  pthread_mutex_unlock(&m_waitlock) ;
+#else
+  // Interrupt handlers run as ISRs so poll the event count
+  while (m_events == events){
+    if (timeout_ms != RF24_WAIT_FOREVER && rf24_micros() - start >= limit) return false ;
+    m_pTimer->microSleep(100) ;
+  }
+#endif
+  return true ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::enable_power(bool bPower)
+{
+  lock() ;
+  // Enable power
+  if (bPower){
+    if (!is_powered_up()){
+      power_up(true);
+      if (!m_auto_update) write_config() ;
+      // 130 micro seconds to settle power. Any mode change already
+      // settling keeps its state
+      if (m_state == rf24_power_down) set_state(rf24_standby, RF24_SETTLE_US) ;
+      else extend_settle(RF24_SETTLE_US) ;
+    }
+  }else{ // Power off
+    if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)){
+      unlock() ;
+      return false ;
+    }
+    if (is_powered_up()){
+      power_up(false);
+      if (!m_auto_update) write_config() ;
+    }
+    set_state(rf24_power_down, 0) ;
+  }
+  
+  unlock() ;
+  return true ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::listen_mode(bool bListen)
+{
+  
+  
+  lock() ;
+  // Set CE low
+  if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)){
+    unlock() ;
+    return false;
+  }
+  // Setup receiver or as sender
+  receiver(bListen);
+  if (!m_auto_update) write_config() ;
+  
+  if (bListen){
+    // If listening the set CE high again to go into listen mode
+    if (!m_pGPIO->output(m_ce, IHardwareGPIO::high)){
+      unlock() ;
+      return false ;
+    }
+  }
+  // Settle for 130 micro seconds. Readers and writers wait on the deadline
+  set_state(bListen?rf24_rx_settling:rf24_tx_settling, RF24_SETTLE_US) ;
+  unlock() ;
+  
+  // Enable power if not powered on
+  if (!enable_power(true)) return false ;
+  return true ;
+}
+
+BUFFERED_TEMPLATE
+uint16_t BUFFERED_CLASS::write(uint8_t *buffer, uint16_t length, bool blocking, uint32_t timeout_ms)
+{
+  uint32_t start = rf24_micros() ;
+  uint16_t buffer_remaining = WRITE_CAPACITY - m_write_size ;
+  uint16_t len = length ;
+  uint8_t packet_size = get_transmit_width() ;
+
+  if (packet_size > PAYLOAD_WIDTH) return 0 ; // packets won't fit the buffers
+
+  // Mode change must have settled before CE is pulsed
+  wait_settled() ;
+  lock() ;
+  // Write using remaining space in the data buffer
+  if (buffer_remaining < length){
+    len = buffer_remaining ;
+    if (len == 0){
+      unlock() ;
+      m_status = buff_overflow ;
+      return 0 ; // no more buffer left, need to transmit current buffer
+    }
+  }
+
+  memcpy((void *)(m_write_buffer+m_write_size), buffer, len) ;
+  if (m_write_size == 0){
+    // Fresh write
+    m_status = ok ;
+    flushtx() ; // TX buffer may have unsent data if previously failed
+    // Initial data is smaller than a packet.
+    // pad with zeros. Note that whole packets really should be used
+    // by an implementer of this class.
+    if (len < packet_size){
+      uint8_t pktbuff[PAYLOAD_WIDTH] ; // max length buffer
+      memset(pktbuff, 0, PAYLOAD_WIDTH); // use zeros to pad packet
+      memcpy(pktbuff, buffer, len) ;
+      m_front_write = write_packet(pktbuff) ;
+    }else{
+      // Normal write of a full packet of data
+      m_front_write = write_packet((uint8_t*)m_write_buffer) ;
+    }
+    if (!m_front_write){
+      unlock() ;
+      // no date returned from write_packet
+      // set as an IO error
+      m_status = io_err ; 
+      return 0;
+    }
+  }
+
+  m_write_size += len ;
+  // release thread locks
+  unlock() ;
+
+  if (blocking){
+    // Just write this data and wait for the interrupt handlers to complete it
+    for(;;){
+      uint32_t events = m_events ;
+      if (m_write_size == 0) break ;
+      if(m_status == io_err) return 0 ;
+      if (!wait_event(events, start, timeout_ms)){
+	m_status = timeout ;
+	return 0 ;
+      }
+    }
+    if (m_status == max_retry_failure) return 0 ;
+  }
+
+  return len ;
+}
+
+BUFFERED_TEMPLATE
+uint16_t BUFFERED_CLASS::queue_packets(const uint8_t *data, uint16_t length)
+{
+  uint8_t packet_size = get_transmit_width() ;
+  uint16_t len = 0 ;
+
+  lock() ;
+  bool idle = (m_write_size == 0) ;
+  // Drop packets already handed to the radio to make room. The last
+  // packet in flight is kept so the buffer isn't seen as idle until TX_DS
+  if (!idle && m_front_write > 0 && m_front_write < m_write_size){
+    memmove((void *)m_write_buffer, (void *)(m_write_buffer+m_front_write),
+	    m_write_size - m_front_write) ;
+    m_write_size -= m_front_write ;
+    m_front_write = 0 ;
+  }
+  len = WRITE_CAPACITY - m_write_size ;
+  if (len > length) len = length ;
+  len -= len % packet_size ;
+  if (len == 0){
+    unlock() ;
+    return 0 ;
+  }
+  memcpy((void *)(m_write_buffer+m_write_size), data, len) ;
+  m_write_size += len ;
+  if (idle){
+    // Nothing is sending so start the interrupt driven chain
+    flushtx() ;
+    m_front_write = write_packet((uint8_t*)m_write_buffer) ;
+    if (!m_front_write){
+      m_status = io_err ;
+      m_write_size = 0 ;
+      len = 0 ;
+    }
+  }
+  unlock() ;
+  return len ;
+}
+
+BUFFERED_TEMPLATE
+uint32_t BUFFERED_CLASS::queue_stream(const uint8_t *data, uint32_t length, uint32_t start, uint32_t timeout_ms)
+{
+  uint32_t queued = 0 ;
+  while (queued < length){
+    uint32_t events = m_events ;
+    if (m_status == max_retry_failure || m_status == io_err) break ;
+    uint32_t remaining = length - queued ;
+    uint16_t n = queue_packets(data + queued, remaining > WRITE_CAPACITY?WRITE_CAPACITY:remaining) ;
+    queued += n ;
+    // Back pressure. Wait for the interrupt handlers to free space
+    if (n == 0 && !wait_event(events, start, timeout_ms)){
+      m_status = timeout ;
+      break ;
+    }
+  }
+  return queued ;
+}
+
+BUFFERED_TEMPLATE
+uint32_t BUFFERED_CLASS::write_stream(const uint8_t *data, uint32_t length, uint32_t timeout_ms)
+{
+  uint32_t start = rf24_micros(), accepted = 0 ;
+  uint8_t packet_size = get_transmit_width() ;
+
+  if (packet_size == 0 || packet_size > PAYLOAD_WIDTH) return 0 ;
+  // Mode change must have settled before CE is pulsed
+  wait_settled() ;
+  if (m_write_size == 0) m_status = ok ; // clear any earlier failure
+
+  while (accepted < length || m_stream_tail_len == packet_size){
+    uint32_t count = length - accepted ;
+    if (m_stream_tail_len > 0 || count < packet_size){
+      // Complete the held partial packet before sending anything else
+      uint32_t n = packet_size - m_stream_tail_len ;
+      if (n > count) n = count ;
+      memcpy(m_stream_tail + m_stream_tail_len, data + accepted, n) ;
+      m_stream_tail_len += n ;
+      accepted += n ;
+      if (m_stream_tail_len < packet_size) break ; // wait for more data
+      if (queue_stream(m_stream_tail, packet_size, start, timeout_ms) < packet_size) break ;
+      m_stream_tail_len = 0 ;
+    }else{
+      count -= count % packet_size ;
+      uint32_t n = queue_stream(data + accepted, count, start, timeout_ms) ;
+      accepted += n ;
+      if (n < count) break ;
+    }
+  }
+  return accepted ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::flush_stream(uint32_t timeout_ms)
+{
+  uint32_t start = rf24_micros() ;
+  uint8_t packet_size = get_transmit_width() ;
+
+  wait_settled() ;
+  if (m_stream_tail_len > 0){
+    // Pad with zeros as for write
+    memset(m_stream_tail + m_stream_tail_len, 0, packet_size - m_stream_tail_len) ;
+    if (queue_stream(m_stream_tail, packet_size, start, timeout_ms) < packet_size) return false ;
+    m_stream_tail_len = 0 ;
+  }
+  for(;;){
+    uint32_t events = m_events ;
+    if (m_write_size == 0) break ;
+    if (m_status == io_err) return false ;
+    if (!wait_event(events, start, timeout_ms)){
+      m_status = timeout ;
+      return false ;
+    }
+  }
+  return m_status == ok ;
+}
+
+BUFFERED_TEMPLATE
+uint16_t BUFFERED_CLASS::read_stream(uint8_t *buffer, uint16_t length, uint8_t pipe, uint32_t timeout_ms)
+{
+  return read(buffer, length, pipe, true, timeout_ms) ;
+}
+
+BUFFERED_TEMPLATE
+typename BUFFERED_CLASS::enStatus BUFFERED_CLASS::get_status()
+{
+  return m_status ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::max_retry_interrupt()
+{
+  lock() ;
+  m_write_size = m_front_write = 0 ; // Reset
+  flushtx() ;
+  
+  // Set the failure status
+  m_status = max_retry_failure ;
+  unlock() ;
+  notify() ;
+  return true ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::data_sent_interrupt()
+{
+  uint8_t rembuf[PAYLOAD_WIDTH] ;
+  uint16_t size = 0, ret = 0;
+
+  lock() ;
+  uint8_t packet_size = get_transmit_width() ;
+
+  if (m_front_write > m_write_size) size = 0 ;
+  else size = m_write_size - m_front_write ;
+
+  if (size == 0){
+    // No data to send. End of transmission
+    m_front_write = m_write_size = 0;
+    unlock() ;
+    notify() ;
+    return true ;
+  }
+  
+  // This could be considered an error if the size is less than the packet_size
+  // as the remaining data shouldn't be in the data stream.
+  // Works for dynamic data packets used in Enhanced Shockburst
+  if (size <= packet_size){ 
+    memset(rembuf,0,PAYLOAD_WIDTH) ; // Clear buffer
+    memcpy(rembuf, (void *)(m_write_buffer+m_front_write), size) ; // Partial packet write
+
+    ret = write_packet(rembuf) ;
+  }else{
+    // Write another packet
+    ret = write_packet((uint8_t*)m_write_buffer+m_front_write) ;
+  }
+  if (ret == 0) m_status = io_err ; // flag an error
+  m_front_write += ret ;
+   
+  unlock() ;
+  // Wake stream writers waiting for buffer space
+  notify() ;
+
+  return true ;
+}
+
+BUFFERED_TEMPLATE
+uint16_t BUFFERED_CLASS::read(uint8_t *buffer, uint16_t length, uint8_t pipe, bool blocking, uint32_t timeout_ms)
+{
+  uint32_t start = rf24_micros() ;
+  uint16_t len = length ;
+  uint16_t buff_size = 0 ;
+
+  if (!is_buffered(pipe)) return 0 ; // out of range or not buffered
+  const uint8_t slot = pipe_slot(pipe) ;
+
+  // Check if there's unread data in the buffer
+  buff_size = m_read_size[slot] - m_front_read[slot] ; 
+  if (length > buff_size) len = buff_size ; // length larger than remaining buffer
+
+  if (len == 0 && blocking){
+    // Wait until the interrupt handler fills the buffer
+    for(;;){
+      uint32_t events = m_events ;
+      if ((len=m_read_size[slot] - m_front_read[slot]) > 0) break ;
+      if(m_status == io_err) return 0 ;
+      else if(m_status == buff_overflow) return 0 ;
+      if (!wait_event(events, start, timeout_ms)){
+	m_status = timeout ;
+	return 0 ;
+      }
+    }
+    if (len > length) len = length ; // ensure just enough data is read
+  }
+  
+  lock() ;
+
+  if (len > 0){
+    memcpy(buffer, (void *)(m_read_buffer[slot]+m_front_read[slot]), len) ;
+    m_front_read[slot] += len ;
+  }
+  
+  // Check if there's more data in the buffer following this read
+  if((m_front_read[slot] > m_read_size[slot]) ||
+     (m_read_size[slot] - m_front_read[slot] == 0)){
+    // No more data, reset buffer
+    m_front_read[slot] = 0 ; // reset lead pointer to buffer
+    m_read_size[slot] = 0 ; // reset and reuse buffer
+    m_status = ok ;
+  }else if (m_front_read[slot] > 0){
+    // Move unread data to the front so the interrupt handler can keep
+    // filling the buffer while a stream is partially read
+    memmove((void *)m_read_buffer[slot], (void *)(m_read_buffer[slot]+m_front_read[slot]),
+	    m_read_size[slot] - m_front_read[slot]) ;
+    m_read_size[slot] -= m_front_read[slot] ;
+    m_front_read[slot] = 0 ;
+  }
+
+  unlock() ;
+
+  return len ;
+}
+
+BUFFERED_TEMPLATE
+bool BUFFERED_CLASS::data_received_interrupt()
+{
+  // STATUS was published by the interrupt handler
+  if (get_pipe_available() == RF24_PIPE_EMPTY) return true ; // no pipe
+
+  lock() ;
+  bool empty = is_rx_empty() ;
+  while(!empty){
+    // read_payload refreshes STATUS so this is the pipe of the next payload
+    uint8_t pipe = get_pipe_available() ;
+    if (pipe == RF24_PIPE_EMPTY) break ;
+    uint8_t size = get_rx_data_size(pipe) ;
+    if (size == 0){
+      // Width read failed. Nothing can be read from the FIFO
+      flushrx() ;
+      break ;
+    }
+    if (!is_buffered(pipe)){
+      // No buffer for this pipe. Drop only this payload so those queued
+      // behind it for buffered pipes are kept
+      uint8_t discard[MAX_RXTXBUF] ;
+      if (!read_payload(discard, size)){
+	m_status = io_err ;
+	unlock() ;
+	notify() ;
+	return false ;
+      }
+      empty = reg_bit(m_reg_fifo, 0) ;
+      continue ;
+    }
+    const uint8_t slot = pipe_slot(pipe) ;
+    if ((READ_CAPACITY - m_read_size[slot]) < size){
+      m_status = buff_overflow ;
+      unlock() ;
+      notify() ;
+      return false ; // no more buffer
+    }
+    if (!read_payload((uint8_t*)m_read_buffer[slot]+m_read_size[slot], size)){
+      m_status = io_err ; // SPI error
+      unlock() ;
+      notify() ;
+      return false ;
+    }
+    m_read_size[slot] += size ;
+    // read_payload refreshes FIFO_STATUS
+    empty = reg_bit(m_reg_fifo, 0) ;
+  }
+  
+  unlock() ;
+  notify() ;
+
+  return true ;
+}
+
+#undef BUFFERED_TEMPLATE
+#undef BUFFERED_CLASS
+
+#endif
@@ -28,12 +28,26 @@ int opt_irq = 0,
   opt_ce = 0,
   opt_channel = 0,
   opt_speed = 1;
+const char *opt_metrics = NULL ;
+bool opt_warm = false ;
 
+void write_metrics()
+{
+  RF24Stats stats ;
+  if (!opt_metrics) return ;
+  radio.get_stats(stats) ;
+  if (!write_prometheus_stats(&stats, opt_metrics, NULL))
+    fprintf(stderr, "Failed to write metrics to %s\n", opt_metrics) ;
+}
 
 void siginterrupt(int sig)
 {
+  RF24Stats stats ;
   printf("\nExiting and resetting radio\n") ;
   radio.shutdown() ;
+  radio.get_stats(stats) ;
+  print_stats(&stats) ;
+  write_metrics() ;
   exit(EXIT_SUCCESS) ;
 }
 
@@ -47,7 +61,7 @@ bool data_received(void* ctx, uint8_t* sender, uint8_t* packet)
 
 int main(int argc, char **argv)
 {
-  const char usage[] = "Usage: %s -c ce -i irq -a address [-o channel] [-s 250|1|2]\n" ;
+  const char usage[] = "Usage: %s -c ce -i irq -a address [-o channel] [-s 250|1|2] [-m metrics_file] [-w]\n" ;
   int opt = 0 ;
   uint8_t rf24address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
   bool opt_addr_set = false ;
@@ -63,7 +77,7 @@ int main(int argc, char **argv)
     return EXIT_FAILURE ;
   }
   
-  while ((opt = getopt(argc, argv, "s:i:c:o:a:")) != -1) {
+  while ((opt = getopt(argc, argv, "s:i:c:o:a:m:w")) != -1) {
     switch (opt) {
     case 'i': // IRQ pin
       opt_irq = atoi(optarg) ;
@@ -77,6 +91,12 @@ int main(int argc, char **argv)
     case 's': // speed
       opt_speed = atoi(optarg) ;
       break ;
+    case 'm': // Prometheus textfile
+      opt_metrics = optarg ;
+      break ;
+    case 'w': // warm start
+      opt_warm = true ;
+      break ;
     case 'a': // address
       if (!straddr_to_addr(optarg, rf24address, PACKET_DRIVER_MAX_ADDRESS_LEN)){
 	fprintf(stderr, "Invalid address\n") ;
@@ -126,6 +146,11 @@ int main(int argc, char **argv)
   // 1 MHz = 1000 KHz
   spi.setSpeed(6000000) ;
   radio.set_spi(&spi) ;
+
+  // Submit multi-command sequences in one ioctl. Falls back to
+  // single transfers if the device cannot be opened again
+  RF24SpidevBatch batch ;
+  if (batch.open(0, 0, 6000000)) radio.set_spi_batch(&batch) ;
   radio.set_timer(&pi) ;
   
   if (!radio.set_gpio(&pi, opt_ce, opt_irq)){
@@ -136,6 +161,7 @@ int main(int argc, char **argv)
   uint8_t broadcast[PACKET_DRIVER_MAX_ADDRESS_LEN] = {0xC0,0xC0,0xC0,0xC0,0xC0} ;
 
   radio.set_data_received_callback(&data_received) ;
+  radio.set_warm_start(opt_warm) ;
   if (!radio.initialise(rf24address, broadcast, PACKET_DRIVER_MAX_ADDRESS_LEN)){
     fprintf(stderr, "Failed to initialise driver\n") ;
     return 1 ;
@@ -160,6 +186,7 @@ int main(int argc, char **argv)
 	if (!radio.send(recipient, (uint8_t *)szMessage, j+1)){
 	  fprintf(stderr, "Failed to send message: %s\n", szMessage) ;
 	}
+	write_metrics() ;
       }
       i = 0;
       j = 0;
@@ -99,34 +99,38 @@ bool PingRF24::initialise(uint8_t channel)
   if (!m_pGPIO || !m_pSPI) return false ;
 
   if (!reset_rf24()) return false ;
-  
+
+  RadioConfig config ;
   // Enable all interrupts
-  set_use_interrupt_data_ready(true);
-  set_use_interrupt_data_sent(true);
-  set_use_interrupt_max_retry(true);
+  config.interrupt_data_ready = true ;
+  config.interrupt_data_sent = true ;
+  config.interrupt_max_retry = true ;
 
   // 16bit CRC enabled
-  crc_enabled(true) ;
-  set_2_byte_crc(true);
+  config.crc = true ;
+  config.crc_2byte = true ;
 
   // Configure pipe 0 as transmit ACK buffer
-  set_pipe_ack(0, true);
-  if (!set_payload_width(0,32)) return false ; // 32 byte pings
+  config.pipe[0].ack = true ;
+  config.pipe[0].width = 32 ; // 32 byte pings
 
   // Configure pipe 1 to receive
-  enable_pipe(1, true) ;
-  set_pipe_ack(1, true);
-  if (!set_payload_width(1,32)) return false ; // 32 byte pings 
-
-  if (!set_channel(channel)) return false ; // use specified channel
-  if (!set_retry(15,15)) return false ; // max retry and delay values
-  if (!set_address_width(ADDR_WIDTH)) return false; // 5 byte addresses
+  config.pipe[1].enabled = true ;
+  config.pipe[1].ack = true ;
+  config.pipe[1].width = 32 ; // 32 byte pings
+
+  config.channel = channel ; // use specified channel
+  config.retry_delay = 15 ; // max retry and delay values
+  config.retry_count = 15 ;
+  config.address_width = ADDR_WIDTH ; // 5 byte addresses
   
-  set_power_level(RF24_0DBM) ; // max power
-  set_data_rate(RF24_1MBPS) ; // 1 MB per sec rate
+  config.power_level = RF24_0DBM ; // max power
+  config.data_rate = RF24_1MBPS ; // 1 MB per sec rate
+  config.transmit_width = 32 ; // 32 byte pings
 
+  // Fails if the channel is out of range
+  if (!apply(config)) return false ;
   if (!clear_interrupts()) return false ;
-  if (!set_transmit_width(32)) return false ; // 32 byte pings
 
   if (!flushtx()) return false ;
   if (!flushrx()) return false ;
@@ -3,52 +3,93 @@
 #include <errno.h>
 #include <string.h>
 
+static void print_address(const uint8_t *address, uint8_t width)
+{
+  printf("[") ;
+  // Print backwards so MSB is printed first
+  for (int j=width-1; j >= 0; j--){
+    printf(" %X ",address[j]) ;
+  }
+  printf("]\n");
+}
+
 void print_state(NordicRF24 *pRadio)
+{
+  RF24Registers regs ;
+  if (!pRadio->read_registers(regs)){
+    fprintf(stderr, "Cannot read radio registers\n") ;
+    return ;
+  }
+  print_registers(&regs) ;
+}
+
+void print_registers(const RF24Registers *regs)
 {
   int i=0 ;
-  uint8_t addr_width = pRadio->get_address_width() ;
-  uint8_t address[5], w=0 ;
+  uint8_t addr_width = regs->get_address_width() ;
+  uint8_t address[MAX_RF24_ADDRESS_LEN] ;
   
-  printf("Data Ready Interrupt: %s\n", pRadio->use_interrupt_data_ready()?"true":"false") ;
-  printf("Data Sent Interrupt: %s\n", pRadio->use_interrupt_data_sent()?"true":"false") ;
-  printf("Max Retry Interrupt: %s\n", pRadio->use_interrupt_max_retry()?"true":"false") ;
-  printf("CRC Enabled: %s\n", pRadio->is_crc_enabled()?"true":"false") ;
-  printf("Is Powered Up: %s\n", pRadio->is_powered_up()?"true":"false") ;
-  printf("Is Receiver: %s\n", pRadio->is_receiver()?"true":"false") ;
-  printf("2 byte CRC: %s\n", pRadio->is_2_byte_crc()?"true":"false") ;
+  printf("Data Ready Interrupt: %s\n", regs->use_interrupt_data_ready()?"true":"false") ;
+  printf("Data Sent Interrupt: %s\n", regs->use_interrupt_data_sent()?"true":"false") ;
+  printf("Max Retry Interrupt: %s\n", regs->use_interrupt_max_retry()?"true":"false") ;
+  printf("CRC Enabled: %s\n", regs->is_crc_enabled()?"true":"false") ;
+  printf("Is Powered Up: %s\n", regs->is_powered_up()?"true":"false") ;
+  printf("Is Receiver: %s\n", regs->is_receiver()?"true":"false") ;
+  printf("2 byte CRC: %s\n", regs->is_2_byte_crc()?"true":"false") ;
   printf("Address Width: %d\n", addr_width);
-  printf("Retry Delay: %d\n", pRadio->get_retry_delay()) ;
-  printf("Retry Count: %d\n", pRadio->get_retry_count()) ;
-  printf("Channel: %d\n", pRadio->get_channel()) ;
-  printf("Power Level: %d\n",pRadio->get_power_level());
-  printf("Data Rate: %d\n",pRadio->get_data_rate());
-  printf("Continuous Carrier: %s\n", pRadio->is_continuous_carrier_transmit()?"true":"false") ;
-  printf("Dynamic Payloads: %s\n", pRadio->dynamic_payloads_enabled()?"true":"false") ;
-  printf("Payload ACK: %s\n", pRadio->payload_ack_enabled()?"true":"false") ;
-  printf("TX No ACK: %s\n", pRadio->tx_noack_cmd_enabled()?"true":"false") ;
+  printf("Retry Delay: %d\n", regs->get_retry_delay()) ;
+  printf("Retry Count: %d\n", regs->get_retry_count()) ;
+  printf("Channel: %d\n", regs->get_channel()) ;
+  printf("Power Level: %d\n",regs->get_power_level());
+  printf("Data Rate: %d\n",regs->get_data_rate());
+  printf("Continuous Carrier: %s\n", regs->is_continuous_carrier_transmit()?"true":"false") ;
+  printf("Dynamic Payloads: %s\n", regs->dynamic_payloads_enabled()?"true":"false") ;
+  printf("Payload ACK: %s\n", regs->payload_ack_enabled()?"true":"false") ;
+  printf("TX No ACK: %s\n", regs->tx_noack_cmd_enabled()?"true":"false") ;
   
   for (i=0; i < RF24_PIPES;i++){
-    printf("Pipe %d Enabled: %s\n", i, pRadio->is_pipe_enabled(i)?"true":"false") ;
-    printf("Pipe %d ACK: %s\n", i, pRadio->is_pipe_ack(i)?"true":"false") ;
-    pRadio->get_rx_address(i, address, &addr_width) ;
-    printf("Pipe %d Address: [", i) ;
-    // Print backwards so MSB is printed first
-    for (int j=addr_width-1; j >= 0; j--){
-      printf(" %X ",address[j]) ;
-    }
-    printf("]\n");
-    pRadio->get_payload_width(i, &w) ;
-    printf("Pipe %d Payload Width: %d\n", i,w) ;
-    printf("Pipe %d Dynamic Payloads: %s\n\n", i, pRadio->is_dynamic_payload(i)?"true":"false") ;
+    printf("Pipe %d Enabled: %s\n", i, regs->is_pipe_enabled(i)?"true":"false") ;
+    printf("Pipe %d ACK: %s\n", i, regs->is_pipe_ack(i)?"true":"false") ;
+    regs->get_rx_address(i, address) ;
+    printf("Pipe %d Address: ", i) ;
+    print_address(address, addr_width) ;
+    printf("Pipe %d Payload Width: %d\n", i,regs->get_payload_width(i)) ;
+    printf("Pipe %d Dynamic Payloads: %s\n\n", i, regs->is_dynamic_payload(i)?"true":"false") ;
   }
 
-  pRadio->get_tx_address(address,&addr_width) ;
-  printf("Transmit Address: [") ;
-  for (int j=addr_width-1; j >= 0; j--){
-    printf(" %X ",address[j]) ;
+  printf("Transmit Address: ") ;
+  print_address(regs->tx_addr, addr_width) ;
+}
+
+static const char *register_names[RF24_REGISTERS] = {
+  "CONFIG", "EN_AA", "EN_RXADDR", "SETUP_AW", "SETUP_RETR", "RF_CH",
+  "RF_SETUP", "STATUS", "OBSERVE_TX", "CD", "RX_ADDR_P0", "RX_ADDR_P1",
+  "RX_ADDR_P2", "RX_ADDR_P3", "RX_ADDR_P4", "RX_ADDR_P5", "TX_ADDR",
+  "RX_PW_P0", "RX_PW_P1", "RX_PW_P2", "RX_PW_P3", "RX_PW_P4", "RX_PW_P5",
+  "FIFO_STATUS", NULL, NULL, NULL, NULL, "DYNPD", "FEATURE"} ;
+
+int print_register_changes(const RF24Registers *prev, const RF24Registers *cur)
+{
+  int changes = 0 ;
+  uint8_t width = cur->get_address_width() ;
+
+  for (uint8_t addr=0; addr < RF24_REGISTERS; addr++){
+    if (RF24Registers::is_reserved(addr)) continue ;
+    if (RF24Registers::is_address(addr)){
+      const uint8_t *a = prev->address(addr), *b = cur->address(addr) ;
+      if (memcmp(a, b, MAX_RF24_ADDRESS_LEN) == 0) continue ;
+      printf("%02X %-12s ", addr, register_names[addr]) ;
+      print_address(a, width) ;
+      printf("%15s-> ", "") ;
+      print_address(b, width) ;
+    }else{
+      if (prev->reg[addr] == cur->reg[addr]) continue ;
+      printf("%02X %-12s %02X -> %02X\n", addr, register_names[addr],
+	     prev->reg[addr], cur->reg[addr]) ;
+    }
+    changes++ ;
   }
-  printf("]\n");
-  
+  return changes ;
 }
 
 int straddr_to_addr(const char *str, uint8_t *rf24addr, const unsigned int len)
@@ -86,3 +127,121 @@ void addr_to_straddr(uint8_t *rf24addr, char *szaddress, const uint8_t address_l
     p += 2;
   }
 }
+
+static const char *spi_cmd_names[spi_cmd_count] = {
+  "r_register", "w_register", "r_rx_payload", "w_tx_payload",
+  "flush_tx", "flush_rx", "r_rx_pl_wid", "other"} ;
+
+static void print_histogram(const char *name, const uint32_t *hist)
+{
+  printf("%s:", name) ;
+  for (int i=0; i < RF24_HIST_BUCKETS; i++){
+    if (hist[i] == 0) continue ;
+    if (i == RF24_HIST_BUCKETS-1) printf(" >=%lu:%u", 1UL << (i-1), hist[i]) ;
+    else printf(" <%lu:%u", 1UL << i, hist[i]) ;
+  }
+  printf("\n") ;
+}
+
+void print_stats(const RF24Stats *stats)
+{
+  for (int i=0; i < spi_cmd_count; i++)
+    printf("SPI %s: %u\n", spi_cmd_names[i], stats->spi_cmd[i]) ;
+  printf("SPI bytes: %u\n", stats->spi_bytes) ;
+  printf("IRQs: %u\n", stats->irqs) ;
+  printf("RX payloads: %u\n", stats->rx_payloads) ;
+  printf("RX FIFO full: %u\n", stats->rx_fifo_full) ;
+  printf("TX FIFO full: %u\n", stats->tx_fifo_full) ;
+  printf("Flush TX: %u\n", stats->flush_tx) ;
+  printf("Flush RX: %u\n", stats->flush_rx) ;
+  printf("MAX_RT: %u\n", stats->max_rt) ;
+  printf("TX_DS: %u\n", stats->tx_ds) ;
+  print_histogram("TX_DS latency us", stats->tx_ds_latency) ;
+  printf("Lock count: %u\n", stats->lock_count) ;
+  printf("Lock wait us: %llu\n", (unsigned long long)stats->lock_wait_us) ;
+  printf("Lock hold us: %llu (max %u)\n", (unsigned long long)stats->lock_hold_us, stats->lock_hold_max_us) ;
+  print_histogram("Lock hold us", stats->lock_hold) ;
+  printf("Delays: %u\n", stats->delay_count) ;
+  printf("Delay overshoot ns: %llu (mean %llu, max %u)\n", (unsigned long long)stats->delay_error_ns,
+	 (unsigned long long)(stats->delay_count?stats->delay_error_ns / stats->delay_count:0),
+	 stats->delay_error_max_ns) ;
+}
+
+#ifndef ARDUINO
+static void write_prometheus_histogram(FILE *f, const char *name, const char *help,
+				       const uint32_t *hist, uint64_t sum, const char *label, const char *labelc)
+{
+  uint32_t cumulative = 0 ;
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name) ;
+  for (int i=0; i < RF24_HIST_BUCKETS-1; i++){
+    cumulative += hist[i] ;
+    // Bucket i counts values below 2^i so the inclusive bound is 2^i - 1
+    fprintf(f, "%s_bucket{%sle=\"%lu\"} %u\n", name, labelc, (1UL << i) - 1, cumulative) ;
+  }
+  cumulative += hist[RF24_HIST_BUCKETS-1] ;
+  fprintf(f, "%s_bucket{%sle=\"+Inf\"} %u\n", name, labelc, cumulative) ;
+  fprintf(f, "%s_sum{%s} %llu\n", name, label, (unsigned long long)sum) ;
+  fprintf(f, "%s_count{%s} %u\n", name, label, cumulative) ;
+}
+
+int write_prometheus_stats(const RF24Stats *stats, const char *filename, const char *instance)
+{
+  char tmpname[256], label[64] = "", labelc[64] = "" ;
+  FILE *f = NULL ;
+
+  if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >= (int)sizeof(tmpname)) return 0 ;
+  if (instance){
+    snprintf(label, sizeof(label), "instance=\"%s\"", instance) ;
+    snprintf(labelc, sizeof(labelc), "instance=\"%s\",", instance) ;
+  }
+  f = fopen(tmpname, "w") ;
+  if (!f) return 0 ;
+
+  fprintf(f, "# HELP rf24_spi_transactions_total SPI transactions by command\n") ;
+  fprintf(f, "# TYPE rf24_spi_transactions_total counter\n") ;
+  for (int i=0; i < spi_cmd_count; i++)
+    fprintf(f, "rf24_spi_transactions_total{%scmd=\"%s\"} %u\n", labelc, spi_cmd_names[i], stats->spi_cmd[i]) ;
+
+#define PROM_COUNTER(name, help, value) \
+  fprintf(f, "# HELP " name " " help "\n# TYPE " name " counter\n" name "{%s} %llu\n", \
+	  label, (unsigned long long)(value))
+  PROM_COUNTER("rf24_spi_bytes_total", "Bytes clocked over SPI", stats->spi_bytes) ;
+  PROM_COUNTER("rf24_irqs_total", "Interrupts handled", stats->irqs) ;
+  PROM_COUNTER("rf24_rx_payloads_total", "Payloads read from the RX FIFO", stats->rx_payloads) ;
+  PROM_COUNTER("rf24_rx_fifo_full_total", "RX FIFO full events", stats->rx_fifo_full) ;
+  PROM_COUNTER("rf24_tx_fifo_full_total", "TX FIFO full events", stats->tx_fifo_full) ;
+  PROM_COUNTER("rf24_flush_tx_total", "TX FIFO flushes", stats->flush_tx) ;
+  PROM_COUNTER("rf24_flush_rx_total", "RX FIFO flushes", stats->flush_rx) ;
+  PROM_COUNTER("rf24_max_rt_total", "MAX_RT interrupts", stats->max_rt) ;
+  PROM_COUNTER("rf24_tx_ds_total", "TX_DS interrupts", stats->tx_ds) ;
+  PROM_COUNTER("rf24_lock_acquired_total", "Driver mutex acquisitions", stats->lock_count) ;
+  PROM_COUNTER("rf24_lock_wait_microseconds_total", "Time spent waiting for the driver mutex", stats->lock_wait_us) ;
+  PROM_COUNTER("rf24_lock_hold_microseconds_total", "Time spent holding the driver mutex", stats->lock_hold_us) ;
+  PROM_COUNTER("rf24_delays_total", "Precise delays taken", stats->delay_count) ;
+  PROM_COUNTER("rf24_delay_overshoot_nanoseconds_total", "Time waited beyond requested delays", stats->delay_error_ns) ;
+#undef PROM_COUNTER
+  fprintf(f, "# HELP rf24_lock_hold_max_microseconds Longest driver mutex hold\n") ;
+  fprintf(f, "# TYPE rf24_lock_hold_max_microseconds gauge\n") ;
+  fprintf(f, "rf24_lock_hold_max_microseconds{%s} %u\n", label, stats->lock_hold_max_us) ;
+  fprintf(f, "# HELP rf24_delay_overshoot_max_nanoseconds Largest overshoot of a precise delay\n") ;
+  fprintf(f, "# TYPE rf24_delay_overshoot_max_nanoseconds gauge\n") ;
+  fprintf(f, "rf24_delay_overshoot_max_nanoseconds{%s} %u\n", label, stats->delay_error_max_ns) ;
+
+  write_prometheus_histogram(f, "rf24_tx_ds_latency_microseconds",
+			     "Time from write_packet to TX_DS", stats->tx_ds_latency,
+			     stats->tx_ds_latency_us, label, labelc) ;
+  write_prometheus_histogram(f, "rf24_lock_hold_microseconds",
+			     "Driver mutex hold time", stats->lock_hold,
+			     stats->lock_hold_us, label, labelc) ;
+
+  if (fclose(f) != 0){
+    remove(tmpname) ;
+    return 0 ;
+  }
+  if (rename(tmpname, filename) != 0){
+    remove(tmpname) ;
+    return 0 ;
+  }
+  return 1 ;
+}
+#endif
@@ -11,6 +11,16 @@ extern "C"
   /* Print to stdout the state of the radio */
   void print_state(NordicRF24 *pRadio);
 
+  /* Print to stdout a register map read with NordicRF24::read_registers */
+  void print_registers(const RF24Registers *regs) ;
+
+  /*
+     Print to stdout each register which differs between two register maps
+     as the old and new hex values.
+     returns the number of changed registers
+  */
+  int print_register_changes(const RF24Registers *prev, const RF24Registers *cur) ;
+
   /* wraps call to nanosleep - shouldn't be required with use of IHardwareTimer */
   //void nano_sleep(time_t sec, long nano) ;
 
@@ -30,6 +40,20 @@ extern "C"
   */
   void addr_to_straddr(uint8_t *rf24addr, char *szaddress, const uint8_t address_len);
 
+  /* Print to stdout the instrumentation counters of the radio */
+  void print_stats(const RF24Stats *stats) ;
+
+#ifndef ARDUINO
+  /*
+     Write counters in the Prometheus text exposition format for use with the
+     node exporter textfile collector. The file is written to a temporary name
+     and renamed so the collector never reads a partial file.
+     instance labels the metrics and can be NULL.
+     returns 1 on success and 0 on failure
+  */
+  int write_prometheus_stats(const RF24Stats *stats, const char *filename, const char *instance) ;
+#endif
+
 }
 
 
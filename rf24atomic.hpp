@@ -0,0 +1,97 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_ATOMIC
+#define __RF24_ATOMIC
+
+#include <stdint.h>
+
+// Value shared between the interrupt handlers and other threads without
+// holding the driver mutex. Loads acquire and stores release so data
+// written before a store is visible to a thread which loads the new value.
+// AVR has no <atomic> so values are read and written with interrupts
+// disabled, which is enough as the handlers run as ISRs there.
+// Operators follow std::atomic so members can be used as plain values
+#if defined(ARDUINO) && defined(__AVR__)
+
+#include <Arduino.h>
+
+template <class T>
+class RF24Atomic{
+public:
+  RF24Atomic(T v = T()){m_value = v ;}
+  RF24Atomic(const RF24Atomic &) = delete ;
+  RF24Atomic &operator=(const RF24Atomic &) = delete ;
+
+  T load() const {
+    if (sizeof(T) == 1) return m_value ;
+    uint8_t sreg = SREG ;
+    cli() ;
+    T v = m_value ;
+    SREG = sreg ;
+    return v ;
+  }
+  void store(T v){
+    uint8_t sreg = SREG ;
+    cli() ;
+    m_value = v ;
+    SREG = sreg ;
+  }
+  T fetch_add(T v){
+    uint8_t sreg = SREG ;
+    cli() ;
+    T old = m_value ;
+    m_value = old + v ;
+    SREG = sreg ;
+    return old ;
+  }
+
+  operator T() const {return load() ;}
+  T operator=(T v){store(v) ; return v ;}
+  T operator+=(T v){return fetch_add(v) + v ;}
+  T operator-=(T v){return fetch_add((T)(0 - v)) - v ;}
+  T operator++(int){return fetch_add(1) ;}
+
+protected:
+  volatile T m_value ;
+};
+
+#else
+
+#include <atomic>
+
+template <class T>
+class RF24Atomic{
+public:
+  RF24Atomic(T v = T()) : m_value(v){}
+  RF24Atomic(const RF24Atomic &) = delete ;
+  RF24Atomic &operator=(const RF24Atomic &) = delete ;
+
+  T load() const {return m_value.load(std::memory_order_acquire) ;}
+  void store(T v){m_value.store(v, std::memory_order_release) ;}
+  T fetch_add(T v){return m_value.fetch_add(v, std::memory_order_acq_rel) ;}
+
+  operator T() const {return load() ;}
+  T operator=(T v){store(v) ; return v ;}
+  T operator+=(T v){return fetch_add(v) + v ;}
+  T operator-=(T v){return fetch_add((T)(0 - v)) - v ;}
+  T operator++(int){return fetch_add(1) ;}
+
+protected:
+  std::atomic<T> m_value ;
+};
+
+#endif
+
+#endif
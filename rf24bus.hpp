@@ -0,0 +1,82 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_BUS
+#define __RF24_BUS
+
+#include "hardware.hpp"
+#include "rf24time.hpp"
+#include "rf24registers.hpp"
+#include <string.h>
+
+// Hot path primitives of the driver: SPI command framing and the CE pin.
+// SPI, GPIO and Timer are the hardware backend types, see NordicRF24T.
+// GPIO must provide the IHardwareGPIO pin states
+template <class SPI, class GPIO, class Timer>
+class RF24Bus{
+public:
+  RF24Bus(){
+    m_pSPI = NULL ;
+    m_pGPIO = NULL ;
+    m_pTimer = NULL ;
+    m_ce = 0 ;
+  }
+
+  // Clock out cmd followed by len bytes from tx (zeros if tx is NULL).
+  // The STATUS byte clocked in with the command is written to status and
+  // the len bytes following are copied to rx if not NULL.
+  // Returns false if there's no SPI or the transfer fails
+  bool spi_transfer(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len, uint8_t &status){
+    if (!m_pSPI || len > MAX_RXTXBUF) return false ;
+    m_spibuf[0] = cmd ;
+    if (tx) memcpy(m_spibuf+1, tx, len) ;
+    else memset(m_spibuf+1, 0, len) ;
+    if (!m_pSPI->write(m_spibuf, len+1)) return false ;
+    // The frame has been clocked so the buffer is reused for MISO
+    if (!m_pSPI->read(m_spibuf, len+1)) return false ;
+    status = m_spibuf[0] ;
+    if (rx) memcpy(rx, m_spibuf+1, len) ;
+    return true ;
+  }
+
+  // Single byte command such as FLUSH_TX or NOP
+  bool spi_command(uint8_t cmd, uint8_t &status){
+    return spi_transfer(cmd, NULL, NULL, 0, status) ;
+  }
+
+  bool ce_output(bool high){
+    if (!m_pGPIO) return false ;
+    return m_pGPIO->output(m_ce, high?GPIO::high:GPIO::low) ;
+  }
+
+  // Hold CE high for us micro seconds to start a transmit
+  bool pulse_ce(uint32_t us){
+    if (!ce_output(true)) return false ;
+#ifndef ARDUINO
+    rf24_delay_us(us) ;
+#else
+    if (m_pTimer) m_pTimer->microSleep(us) ;
+#endif
+    return ce_output(false) ;
+  }
+
+protected:
+  SPI *m_pSPI ;
+  GPIO *m_pGPIO ;
+  Timer *m_pTimer ;
+  uint8_t m_ce ;
+  uint8_t m_spibuf[MAX_RXTXBUF+1] ; // Add 1 for the command and status byte
+};
+
+#endif
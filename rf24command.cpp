@@ -5,7 +5,11 @@
 #include "wpihardware.hpp"
 #include "spihardware.hpp"
 #include "radioutil.hpp"
+#include "spitrace.hpp"
+#include "rf24time.hpp"
+#include "scanner.hpp"
 #include <string.h>
+#include <signal.h>
 
 void set_channel(NordicRF24 *r, int channel)
 {
@@ -36,69 +40,95 @@ void print_info(NordicRF24 *pRadio)
   printf("TX reuse:\t%s\n", pRadio->is_tx_reuse()?"yes":"no") ;
 }
 
-void scan_channels(NordicRF24 *r, IHardwareTimer *t, IHardwareGPIO *g, int ce)
+volatile bool running = true ;
+
+void siginterrupt(int sig)
 {
-  const int columns = 10 ;
-  const int max_channel = 126;
-  const int retries = 99 ;
-  int col = 0, signal_count = 0;
-  uint8_t original_channel = 0;
-  bool cd ;
-  // Read current channel
-  original_channel = r->get_channel() ;
-  
-  // Setup radio to receive
-  r->power_up(true) ;
-  r->receiver(true) ;
-  t->microSleep(130) ;
-
-  printf("CHAN\t") ;
-  //for (col=0; col < columns; col++) printf("%02X\t", (127*col)/columns) ;
-  for (col=0; col < columns; col++) printf("%02X\t", col) ;
-  printf("\n====\t") ;
-  for (col=0; col < columns; col++) printf("==\t") ;
-  printf("\n") ;
-  col = 0;
-  for (unsigned int chan=0; chan <= max_channel; chan++){
-    if (col == 0) printf("%02X =\t", chan);
-
-    signal_count = 0;
-    for (int j=0; j < retries; j++){
-      r->set_channel(chan) ;
-      g->output(ce, IHardwareGPIO::high) ;
-      t->microSleep(174) ; // Tstby2a +Tdelay_AGC
-      g->output(ce, IHardwareGPIO::low) ;
-      t->microSleep(4);
-      r->carrier_detect(cd);
-      if (cd) signal_count++ ;
-    }
-    if (signal_count == 0){
-      printf("--\t") ;
-    }else{
-      //printf("CD\t") ;
-      printf("%02d\t", signal_count) ;
+  running = false ;
+}
+
+// Run until interrupted by ctrl-c
+void handle_interrupt()
+{
+  struct sigaction siginthandle ;
+  siginthandle.sa_handler = siginterrupt ;
+  sigemptyset(&siginthandle.sa_mask) ;
+  siginthandle.sa_flags = 0 ;
+  sigaction(SIGINT, &siginthandle, NULL) ;
+}
+
+void write_scan(RF24Scanner *scanner, int format)
+{
+  switch(format){
+  case 'j':
+    scanner->write_json(stdout) ;
+    break ;
+  case 'c':
+    scanner->write_csv(stdout) ;
+    break ;
+  default:
+    scanner->write_table(stdout) ;
+  }
+}
+
+bool scan_channels(NordicRF24 *r, IHardwareTimer *t, IHardwareGPIO *g, int ce, bool continuous, int format)
+{
+  RF24Scanner scanner(r, g, t, ce) ;
+
+  if (!continuous){
+    if (!scanner.begin()) return false ;
+    bool ret = scanner.survey() ;
+    scanner.end() ;
+    if (ret) write_scan(&scanner, format) ;
+    return ret ;
+  }
+
+  // Survey continuously in the background and print each new result
+  // until interrupted
+  handle_interrupt() ;
+
+  uint32_t printed = 0 ;
+  if (!scanner.start(0)) return false ;
+  while (running){
+    usleep(100000) ;
+    if (scanner.get_surveys() != printed){
+      printed = scanner.get_surveys() ;
+      write_scan(&scanner, format) ;
     }
+  }
+  scanner.stop() ;
+  return true ;
+}
+
+// Poll the register map and print registers which change until interrupted
+bool watch_registers(NordicRF24 *r, int interval_ms)
+{
+  RF24Registers prev, cur ;
 
-    col++;
-    if (col >= columns){
-      col = 0 ;
-      printf("\n") ;
+  if (!r->read_registers(prev)) return false ;
+  printf("Watching registers every %d ms\n", interval_ms) ;
+  handle_interrupt() ;
+  while (running){
+    usleep(interval_ms * 1000) ;
+    if (!r->read_registers(cur)) return false ;
+    if (print_register_changes(&prev, &cur) > 0){
+      printf("----\n") ;
+      fflush(stdout) ;
     }
+    prev = cur ;
   }
-  printf("\n") ;
-  // Rest channel
-  r->set_channel(original_channel) ;
-  g->output(ce, IHardwareGPIO::low);
-  r->power_up(false) ;
+  return true ;
 }
 
 int main(int argc, char *argv[])
 {
-  const char usage[] = "Usage: %s -c ce [-r] [-o channel] [-p]\n" ;
-  int opt = 0, reset = 0, print = 0, info = 0, scan=0;
+  const char usage[] = "Usage: %s -c ce [-r] [-o channel] [-p] [-i] [-s | -S] [-f table|json|csv] [-w interval_ms] [-t tracefile | -T tracefile]\n" ;
+  int opt = 0, reset = 0, print = 0, info = 0, scan=0, format='t', watch=0;
+  bool continuous = false ;
   int ce = 0, chan = -1 ;
+  const char *tracefile = NULL, *replayfile = NULL ;
   
-  while ((opt = getopt(argc, argv, "o:prisc:")) != -1) {
+  while ((opt = getopt(argc, argv, "o:prisSf:w:c:t:T:")) != -1) {
     switch (opt) {
     case 'r': // reset
       reset = 1;
@@ -115,9 +145,33 @@ int main(int argc, char *argv[])
     case 's':
       scan = 1;
       break ;
+    case 'S': // continuous scan
+      scan = 1 ;
+      continuous = true ;
+      break ;
+    case 'f': // scan output format
+      format = optarg[0] ;
+      if (format != 't' && format != 'j' && format != 'c'){
+	fprintf(stderr, usage, argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break ;
+    case 'w': // watch registers
+      watch = atoi(optarg) ;
+      if (watch <= 0){
+	fprintf(stderr, usage, argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break ;
     case 'c': // CE pin
       ce = atoi(optarg) ;
       break ;
+    case 't': // record SPI trace
+      tracefile = optarg ;
+      break ;
+    case 'T': // replay SPI trace
+      replayfile = optarg ;
+      break ;
     default: // ? opt
       fprintf(stderr, usage, argv[0]);
       exit(EXIT_FAILURE);
@@ -134,25 +188,41 @@ int main(int argc, char *argv[])
   NordicRF24 radio ;
   wPi pi ;
   spiHw spi ;
+  SPITrace trace(&spi, tracefile?RF24_TRACE_DEFAULT_RECORDS:1) ;
+  SPIReplay replay ;
+  IHardwareSPI *pSPI = &spi ;
+  uint32_t start = 0 ;
 
-  if (!spi.spiopen(0,0)){ // init SPI
-    fprintf(stderr, "Cannot Open SPI\n") ;
-    return EXIT_FAILURE;
+  if (replayfile){
+    // Replay a recorded session in place of the radio
+    if (!replay.load(replayfile)){
+      fprintf(stderr, "Cannot load trace %s\n", replayfile) ;
+      return EXIT_FAILURE ;
+    }
+    pSPI = &replay ;
+  }else{
+    if (!spi.spiopen(0,0)){ // init SPI
+      fprintf(stderr, "Cannot Open SPI\n") ;
+      return EXIT_FAILURE;
+    }
+    spi.setCSHigh(false) ;
+    spi.setMode(0) ;
+    spi.setSpeed(6000000) ;
+    if (tracefile) pSPI = &trace ;
   }
-  spi.setCSHigh(false) ;
-  spi.setMode(0) ;
-  spi.setSpeed(6000000) ;
 
   if (!radio.set_gpio(&pi, ce, 0)){
     fprintf(stderr, "Failed to initialise GPIO\n") ;
     return EXIT_FAILURE ;
   }
   
-  radio.set_spi(&spi) ;
+  radio.set_spi(pSPI) ;
   radio.set_timer(&pi) ;
   radio.auto_update(true);
-  
+
+  start = rf24_micros() ;
   if (reset){
+    trace.mark("reset") ;
     printf ("Resetting RF24...\n") ;
     pi.output(ce, IHardwareGPIO::low) ;
     radio.reset_rf24() ;
@@ -162,17 +232,40 @@ int main(int argc, char *argv[])
   }
   if (chan >= 0){
     printf("Setting channel %d\n", chan) ;
+    trace.mark("set_channel") ;
     set_channel(&radio, chan);
   }
   if (print){
+    trace.mark("print_state") ;
     print_state(&radio) ;
   }
   if (info){
     if (print) printf("\n\n") ;
+    trace.mark("print_info") ;
     print_info(&radio);
   }
   if (scan){
-    scan_channels(&radio, &pi, &pi, ce) ;
+    trace.mark("scan_channels") ;
+    if (!scan_channels(&radio, &pi, &pi, ce, continuous, format))
+      fprintf(stderr, "Channel scan failed\n") ;
+  }
+  if (watch){
+    trace.mark("watch_registers") ;
+    if (!watch_registers(&radio, watch))
+      fprintf(stderr, "Cannot read registers\n") ;
+  }
+
+  if (replayfile){
+    printf("\nReplayed %u of %u transfers in %u us, %u mismatched\n",
+	   replay.position(), replay.count(), rf24_micros() - start,
+	   replay.mismatches()) ;
+  }else if (tracefile){
+    printf("\n") ;
+    trace.print_summary(stdout) ;
+    if (!trace.dump(tracefile)){
+      fprintf(stderr, "Cannot write trace %s\n", tracefile) ;
+      return EXIT_FAILURE ;
+    }
   }
   
   return EXIT_SUCCESS;
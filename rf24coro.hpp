@@ -0,0 +1,390 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_CORO
+#define __RF24_CORO
+
+// Optional coroutine layer over RF24Driver. Needs C++20, so build the files
+// which include this header with -std=c++20. The library itself stays C++11.
+// Everything runs on the thread calling RF24Loop::run. Coroutines are
+// resumed from the driver event descriptors (see enable_events) so no
+// thread is needed per conversation
+
+#if !defined(__cpp_impl_coroutine) || defined(ARDUINO)
+ #error "rf24coro.hpp needs C++20 coroutines on Linux (-std=c++20)"
+#endif
+
+#include "RF24Driver.hpp"
+#include <coroutine>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <exception>
+#include <errno.h>
+#include <sys/epoll.h>
+
+// Longest a send waits for TX_DS or MAX_RT, as RF24Driver::send
+#define RF24_CORO_SEND_MS 250
+// Frames kept for later receive calls when nothing is waiting
+#define RF24_CORO_BACKLOG 64
+
+// Frame returned by receive and request. len is 0 on timeout
+struct RF24Message{
+  uint8_t sender[MAX_RF24_ADDRESS_LEN] ;
+  uint8_t data[MAX_RXTXBUF] ;
+  uint8_t len ;
+  uint8_t pipe ;
+};
+
+// Return type for coroutines started on the loop. The coroutine runs
+// straight away until its first co_await and frees itself when finished
+struct RF24Task{
+  struct promise_type{
+    RF24Task get_return_object(){return RF24Task() ;}
+    std::suspend_never initial_suspend() noexcept {return {} ;}
+    std::suspend_never final_suspend() noexcept {return {} ;}
+    void return_void(){}
+    void unhandled_exception(){std::terminate() ;}
+  };
+};
+
+class RF24Loop{
+public:
+  // A coroutine suspended on the loop. Held in the awaiter, which lives in
+  // the coroutine frame until it is resumed
+  struct Waiter{
+    std::coroutine_handle<> handle ;
+    bool any ; // receive from any sender, otherwise only peer
+    bool receiving ; // wants a frame
+    bool sending ; // send not yet completed
+    bool ok ;
+    uint8_t peer[MAX_RF24_ADDRESS_LEN] ;
+    uint8_t tx[MAX_RXTXBUF] ;
+    uint8_t tx_len ;
+    uint64_t deadline ; // ms, 0 for none
+    std::multimap<uint64_t, Waiter*>::iterator timer ;
+    RF24Message msg ;
+  };
+
+  class SendAwaiter{
+  public:
+    SendAwaiter(RF24Loop *loop, const uint8_t *peer, const uint8_t *data, uint8_t len, bool reply, uint32_t timeout_ms){
+      m_loop = loop ;
+      m_waiter.any = false ;
+      m_waiter.receiving = reply ;
+      m_waiter.sending = true ;
+      m_waiter.ok = false ;
+      memcpy(m_waiter.peer, peer, loop->m_address_len) ;
+      m_waiter.tx_len = len > MAX_RXTXBUF?MAX_RXTXBUF:len ;
+      memcpy(m_waiter.tx, data, m_waiter.tx_len) ;
+      m_waiter.msg.len = 0 ;
+      m_timeout_ms = timeout_ms ;
+    }
+    bool await_ready(){return false ;}
+    void await_suspend(std::coroutine_handle<> h){
+      m_waiter.handle = h ;
+      // A reply waiter is listening before the request goes out
+      if (m_waiter.receiving) m_loop->add_receiver(&m_waiter, m_timeout_ms) ;
+      m_loop->queue_send(&m_waiter) ;
+    }
+    // send: true if delivered
+    bool ok() const {return m_waiter.ok ;}
+    RF24Message &message(){return m_waiter.msg ;}
+  protected:
+    RF24Loop *m_loop ;
+    Waiter m_waiter ;
+    uint32_t m_timeout_ms ;
+  };
+
+  struct SendResult : public SendAwaiter{
+    using SendAwaiter::SendAwaiter ;
+    bool await_resume(){return ok() ;}
+  };
+  struct RequestResult : public SendAwaiter{
+    using SendAwaiter::SendAwaiter ;
+    RF24Message await_resume(){return message() ;}
+  };
+
+  class ReceiveAwaiter{
+  public:
+    ReceiveAwaiter(RF24Loop *loop, const uint8_t *peer, uint32_t timeout_ms){
+      m_loop = loop ;
+      m_waiter.any = (peer == NULL) ;
+      m_waiter.receiving = true ;
+      m_waiter.sending = false ;
+      m_waiter.ok = false ;
+      if (peer) memcpy(m_waiter.peer, peer, loop->m_address_len) ;
+      m_waiter.msg.len = 0 ;
+      m_timeout_ms = timeout_ms ;
+    }
+    // Frames which arrived with nothing waiting are taken first
+    bool await_ready(){return m_loop->take_backlog(&m_waiter) ;}
+    void await_suspend(std::coroutine_handle<> h){
+      m_waiter.handle = h ;
+      m_loop->add_receiver(&m_waiter, m_timeout_ms) ;
+    }
+    RF24Message await_resume(){return m_waiter.msg ;}
+  protected:
+    RF24Loop *m_loop ;
+    Waiter m_waiter ;
+    uint32_t m_timeout_ms ;
+  };
+
+  RF24Loop(RF24Driver *pDriver){
+    m_pDriver = pDriver ;
+    m_address_len = pDriver->get_address_len() ;
+    m_epoll = -1 ;
+    m_sending = NULL ;
+    m_send_deadline = 0 ;
+    m_running = false ;
+  }
+  ~RF24Loop(){
+    if (m_epoll >= 0) ::close(m_epoll) ;
+  }
+
+  // Call after the driver is initialised. Enables the driver event
+  // descriptors, so frames without a handler come to this loop
+  bool open(){
+    struct epoll_event ev ;
+    if (!m_pDriver->enable_events()) return false ;
+    m_address_len = m_pDriver->get_address_len() ;
+    if (m_epoll < 0) m_epoll = epoll_create1(EPOLL_CLOEXEC) ;
+    if (m_epoll < 0) return false ;
+    memset(&ev, 0, sizeof(ev)) ;
+    ev.events = EPOLLIN ;
+    ev.data.fd = m_pDriver->rx_event_fd() ;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0 && errno != EEXIST) return false ;
+    ev.data.fd = m_pDriver->tx_event_fd() ;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0 && errno != EEXIST) return false ;
+    return true ;
+  }
+
+  // Awaitables. A timeout of 0 waits forever.
+  // co_await send(...) gives true if delivered. Sends are made one at a
+  // time in the order they were awaited
+  SendResult send(const uint8_t *peer, const uint8_t *data, uint8_t len){
+    return SendResult(this, peer, data, len, false, 0) ;
+  }
+  // co_await receive(...) gives the next frame from any sender
+  ReceiveAwaiter receive(uint32_t timeout_ms){
+    return ReceiveAwaiter(this, NULL, timeout_ms) ;
+  }
+  // co_await receive_from(...) gives the next frame from peer
+  ReceiveAwaiter receive_from(const uint8_t *peer, uint32_t timeout_ms){
+    return ReceiveAwaiter(this, peer, timeout_ms) ;
+  }
+  // Send and wait for the next frame from the same peer. The message has
+  // len 0 if the send fails or nothing arrives in time
+  RequestResult request(const uint8_t *peer, const uint8_t *data, uint8_t len, uint32_t timeout_ms){
+    return RequestResult(this, peer, data, len, true, timeout_ms) ;
+  }
+
+  // Run until stop is called. Returns false on an epoll error
+  bool run(){
+    struct epoll_event events[2] ;
+    if (m_epoll < 0) return false ;
+    m_running = true ;
+    while (m_running){
+      resume_ready() ;
+      if (!m_running) break ;
+      int n = epoll_wait(m_epoll, events, 2, wait_ms()) ;
+      if (n < 0){
+	if (errno == EINTR) continue ;
+	return false ;
+      }
+      for (int i=0; i < n; i++){
+	if (events[i].data.fd == m_pDriver->rx_event_fd()) read_frames() ;
+	else if (events[i].data.fd == m_pDriver->tx_event_fd()) send_done(false) ;
+      }
+      expire(now_ms()) ;
+    }
+    return true ;
+  }
+  // Stop run. Call from a coroutine on the loop
+  void stop(){m_running = false ;}
+
+protected:
+  static uint64_t now_ms(){return rf24_nanos() / 1000000 ;}
+
+  // Reset a driver event descriptor
+  static void clear_event(int fd){
+    uint64_t count ;
+    ssize_t ret = ::read(fd, &count, sizeof(count)) ;
+    (void)ret ;
+  }
+
+  // Pack an address into a key for the peer table
+  uint64_t key(const uint8_t *addr){
+    uint64_t k = 0 ;
+    for (uint8_t i=0; i < m_address_len; i++) k = (k << 8) | addr[i] ;
+    return k ;
+  }
+
+  void set_timer(Waiter *w, uint32_t timeout_ms){
+    w->deadline = timeout_ms?now_ms() + timeout_ms:0 ;
+    if (w->deadline) w->timer = m_timers.insert(std::make_pair(w->deadline, w)) ;
+  }
+
+  void add_receiver(Waiter *w, uint32_t timeout_ms){
+    if (w->any) m_any.push_back(w) ;
+    else m_peers[key(w->peer)].push_back(w) ;
+    set_timer(w, timeout_ms) ;
+  }
+
+  void remove_receiver(Waiter *w){
+    std::deque<Waiter*> *list = &m_any ;
+    if (!w->any){
+      auto it = m_peers.find(key(w->peer)) ;
+      if (it == m_peers.end()) return ;
+      list = &it->second ;
+    }
+    for (auto i = list->begin(); i != list->end(); i++){
+      if (*i == w){
+	list->erase(i) ;
+	break ;
+      }
+    }
+    if (!w->any && list->empty()) m_peers.erase(key(w->peer)) ;
+  }
+
+  // Finished with a waiter. It is resumed from the run loop
+  void complete(Waiter *w){
+    if (w->receiving) remove_receiver(w) ;
+    if (w->deadline) m_timers.erase(w->timer) ;
+    w->deadline = 0 ;
+    w->receiving = false ;
+    m_ready.push_back(w) ;
+  }
+
+  bool take_backlog(Waiter *w){
+    for (auto i = m_backlog.begin(); i != m_backlog.end(); i++){
+      if (w->any || memcmp(i->sender, w->peer, m_address_len) == 0){
+	w->msg = *i ;
+	w->ok = true ;
+	m_backlog.erase(i) ;
+	return true ;
+      }
+    }
+    return false ;
+  }
+
+  void queue_send(Waiter *w){
+    m_sends.push_back(w) ;
+    if (!m_sending) start_next() ;
+  }
+
+  void start_next(){
+    while (!m_sending && !m_sends.empty()){
+      Waiter *w = m_sends.front() ;
+      m_sends.pop_front() ;
+      if (m_pDriver->start_send(w->peer, w->tx, w->tx_len)){
+	m_sending = w ;
+	m_send_deadline = now_ms() + RF24_CORO_SEND_MS ;
+      }else{
+	w->sending = false ;
+	w->ok = false ;
+	complete(w) ;
+      }
+    }
+  }
+
+  // TX descriptor signalled or the send timed out
+  void send_done(bool timed_out){
+    clear_event(m_pDriver->tx_event_fd()) ;
+    if (!m_sending || (!timed_out && m_pDriver->send_pending())) return ;
+    Waiter *w = m_sending ;
+    m_sending = NULL ;
+    w->sending = false ;
+    w->ok = m_pDriver->finish_send() ;
+    // A request carries on waiting for its reply
+    if (!w->receiving || !w->ok) complete(w) ;
+    start_next() ;
+  }
+
+  void read_frames(){
+    RF24Message msg ;
+    clear_event(m_pDriver->rx_event_fd()) ;
+    while ((msg.len = m_pDriver->receive(msg.sender, msg.data, &msg.pipe)) > 0){
+      Waiter *w = NULL ;
+      auto it = m_peers.find(key(msg.sender)) ;
+      if (it != m_peers.end()){
+	// Oldest waiter whose request has gone out
+	for (Waiter *p : it->second){
+	  if (!p->sending){
+	    w = p ;
+	    break ;
+	  }
+	}
+      }
+      if (!w && !m_any.empty()) w = m_any.front() ;
+      if (w){
+	w->msg = msg ;
+	w->ok = true ;
+	complete(w) ;
+      }else{
+	if (m_backlog.size() >= RF24_CORO_BACKLOG) m_backlog.pop_front() ;
+	m_backlog.push_back(msg) ;
+      }
+    }
+  }
+
+  void expire(uint64_t now){
+    if (m_sending && (int64_t)(now - m_send_deadline) >= 0) send_done(true) ;
+    while (!m_timers.empty() && m_timers.begin()->first <= now){
+      Waiter *w = m_timers.begin()->second ;
+      w->msg.len = 0 ;
+      w->ok = false ;
+      // A request still sending is completed when the send finishes
+      if (w->sending){
+	m_timers.erase(m_timers.begin()) ;
+	w->deadline = 0 ;
+	remove_receiver(w) ;
+	w->receiving = false ;
+      }else complete(w) ;
+    }
+  }
+
+  void resume_ready(){
+    while (!m_ready.empty()){
+      Waiter *w = m_ready.front() ;
+      m_ready.pop_front() ;
+      w->handle.resume() ;
+    }
+  }
+
+  int wait_ms(){
+    if (!m_ready.empty()) return 0 ;
+    uint64_t next = 0 ;
+    if (!m_timers.empty()) next = m_timers.begin()->first ;
+    if (m_sending && (next == 0 || m_send_deadline < next)) next = m_send_deadline ;
+    if (next == 0) return -1 ;
+    uint64_t now = now_ms() ;
+    return next > now?(int)(next - now):0 ;
+  }
+
+  RF24Driver *m_pDriver ;
+  uint8_t m_address_len ;
+  int m_epoll ;
+  bool m_running ;
+  std::deque<Waiter*> m_sends ; // waiting to send
+  Waiter *m_sending ; // send in progress
+  uint64_t m_send_deadline ;
+  std::unordered_map<uint64_t, std::deque<Waiter*> > m_peers ; // receive from a peer
+  std::deque<Waiter*> m_any ; // receive from any sender
+  std::multimap<uint64_t, Waiter*> m_timers ; // by deadline
+  std::deque<Waiter*> m_ready ; // to resume
+  std::deque<RF24Message> m_backlog ; // frames nobody was waiting for
+};
+
+#endif
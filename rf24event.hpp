@@ -0,0 +1,59 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_EVENT
+#define __RF24_EVENT
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Readiness signal for event loops. Wraps a non blocking eventfd which
+// becomes readable when signalled and stays readable until cleared, so it
+// can be added to epoll, poll or libuv alongside sockets. Signals are
+// counted so nothing is lost between a clear and the next signal.
+// Open before the interrupt handlers can signal. The descriptor is
+// closed when the object is destroyed
+class RF24Event{
+public:
+  RF24Event(){m_fd = -1 ;}
+  ~RF24Event(){if (m_fd >= 0) ::close(m_fd) ;}
+
+  bool open(){
+    if (m_fd < 0) m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) ;
+    return m_fd >= 0 ;
+  }
+  // Descriptor to wait on or -1 if not open
+  int fd() const {return m_fd ;}
+  bool is_open() const {return m_fd >= 0 ;}
+
+  void signal(){
+    uint64_t one = 1 ;
+    if (m_fd < 0) return ;
+    // Only fails if the count would overflow, which still leaves it readable
+    ssize_t ret = ::write(m_fd, &one, sizeof(one)) ;
+    (void)ret ;
+  }
+  // Reset to not readable. Returns the signals since the last clear
+  uint64_t clear(){
+    uint64_t count = 0 ;
+    if (m_fd < 0 || ::read(m_fd, &count, sizeof(count)) != sizeof(count)) return 0 ;
+    return count ;
+  }
+
+protected:
+  int m_fd ;
+};
+
+#endif
@@ -0,0 +1,194 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "rf24log.hpp"
+
+#if defined(DEBUG) && !defined(ARDUINO)
+
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Single producer, single consumer ring. The owning thread writes at head
+// and the reader thread consumes from tail.
+struct RF24LogRing{
+  RF24LogRecord records[RF24_LOG_RECORDS] ;
+  std::atomic<uint32_t> head ;
+  std::atomic<uint32_t> tail ;
+  uint32_t id ;
+  RF24LogRing *next ;
+};
+
+// Rings are never freed so the reader can walk the list without locking.
+// A thread that exits leaves its ring behind which is acceptable for the
+// handful of threads the driver uses
+static std::atomic<RF24LogRing*> log_rings(NULL) ;
+static std::atomic<uint32_t> log_ring_count(0) ;
+static std::atomic<uint32_t> log_dropped(0) ;
+static std::atomic<bool> log_reader_started(false) ;
+static std::atomic<bool> log_reader_stop(false) ;
+static pthread_t log_reader ;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER ;
+static thread_local RF24LogRing *log_ring = NULL ;
+
+static void *reader_thread(void *)
+{
+  while (!log_reader_stop.load(std::memory_order_acquire)){
+    rf24log_drain(stdout, stderr) ;
+    usleep(RF24_LOG_DRAIN_MS * 1000) ;
+  }
+  return NULL ;
+}
+
+static void start_reader()
+{
+  bool expected = false ;
+  if (!log_reader_started.compare_exchange_strong(expected, true)) return ;
+  if (pthread_create(&log_reader, NULL, reader_thread, NULL) != 0){
+    fprintf(stderr, "rf24log: cannot start reader thread\n") ;
+    return ;
+  }
+  atexit(rf24log_stop) ;
+}
+
+static RF24LogRing *register_ring()
+{
+  RF24LogRing *ring = new RF24LogRing ;
+  ring->head.store(0) ;
+  ring->tail.store(0) ;
+  ring->id = log_ring_count.fetch_add(1) ;
+  ring->next = log_rings.load() ;
+  while (!log_rings.compare_exchange_weak(ring->next, ring)) ;
+  start_reader() ;
+  return ring ;
+}
+
+RF24LogRecord *rf24log_reserve()
+{
+  if (!log_ring) log_ring = register_ring() ;
+  uint32_t head = log_ring->head.load(std::memory_order_relaxed) ;
+  if (head - log_ring->tail.load(std::memory_order_acquire) >= RF24_LOG_RECORDS){
+    log_dropped.fetch_add(1, std::memory_order_relaxed) ;
+    return NULL ;
+  }
+  return &log_ring->records[head & (RF24_LOG_RECORDS-1)] ;
+}
+
+void rf24log_commit()
+{
+  log_ring->head.store(log_ring->head.load(std::memory_order_relaxed) + 1,
+		       std::memory_order_release) ;
+}
+
+// Print one record. Each conversion in the format is printed separately
+// with the argument cast back to the type the conversion expects
+static void format_record(FILE *f, uint32_t id, const RF24LogRecord *rec)
+{
+  char spec[16] ;
+  uint8_t arg = 0 ;
+  const char *p = rec->fmt ;
+
+  fprintf(f, "[%10u.%06u %u] ", rec->timestamp / 1000000, rec->timestamp % 1000000, id) ;
+  while (*p){
+    if (*p != '%'){
+      fputc(*p++, f) ;
+      continue ;
+    }
+    if (p[1] == '%'){
+      fputc('%', f) ;
+      p += 2 ;
+      continue ;
+    }
+    // Copy the conversion specification
+    size_t n = 0 ;
+    bool is_long = false, is_longlong = false ;
+    spec[n++] = *p++ ;
+    while (*p && n < sizeof(spec)-1 && strchr("-+ #0123456789.hlzjt", *p)){
+      if (*p == 'l'){
+	is_longlong = is_long ;
+	is_long = true ;
+      }
+      spec[n++] = *p++ ;
+    }
+    if (!*p) break ;
+    char conv = *p++ ;
+    spec[n++] = conv ;
+    spec[n] = '\0' ;
+    if (arg >= rec->nargs){
+      fputs(spec, f) ; // missing argument
+      continue ;
+    }
+    uint64_t v = rec->args[arg++] ;
+    switch(conv){
+    case 'd': case 'i':
+      if (is_longlong) fprintf(f, spec, (long long)v) ;
+      else if (is_long) fprintf(f, spec, (long)v) ;
+      else fprintf(f, spec, (int)v) ;
+      break ;
+    case 'u': case 'x': case 'X': case 'o': case 'c':
+      if (is_longlong) fprintf(f, spec, (unsigned long long)v) ;
+      else if (is_long) fprintf(f, spec, (unsigned long)v) ;
+      else fprintf(f, spec, (unsigned int)v) ;
+      break ;
+    case 'f': case 'F': case 'g': case 'G': case 'e': case 'E':{
+      double d ;
+      memcpy(&d, &v, sizeof(d)) ;
+      fprintf(f, spec, d) ;
+      break ;
+    }
+    case 's':
+      fprintf(f, spec, (const char *)(uintptr_t)v) ;
+      break ;
+    default:
+      fprintf(f, spec, (void *)(uintptr_t)v) ;
+    }
+  }
+}
+
+uint32_t rf24log_drain(FILE *out, FILE *err)
+{
+  uint32_t count = 0 ;
+  // Only one consumer per ring at a time
+  pthread_mutex_lock(&log_drain_lock) ;
+  for (RF24LogRing *ring = log_rings.load(); ring; ring = ring->next){
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed) ;
+    uint32_t head = ring->head.load(std::memory_order_acquire) ;
+    for (; tail != head; tail++, count++){
+      const RF24LogRecord *rec = &ring->records[tail & (RF24_LOG_RECORDS-1)] ;
+      format_record(rec->level == RF24LogRecord::error?err:out, ring->id, rec) ;
+    }
+    ring->tail.store(tail, std::memory_order_release) ;
+  }
+  pthread_mutex_unlock(&log_drain_lock) ;
+  if (count){
+    fflush(out) ;
+    fflush(err) ;
+  }
+  return count ;
+}
+
+uint32_t rf24log_dropped()
+{
+  return log_dropped.load() ;
+}
+
+void rf24log_stop()
+{
+  if (log_reader_started.load() && !log_reader_stop.exchange(true))
+    pthread_join(log_reader, NULL) ;
+  rf24log_drain(stdout, stderr) ;
+}
+
+#endif
@@ -0,0 +1,105 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_LOG
+#define __RF24_LOG
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Debug logging for the driver.
+// On Linux DEBUG builds DPRINT and EPRINT write a fixed size binary record
+// (format, arguments and timestamp) into a lock free ring owned by the calling
+// thread. No formatting or system calls happen on the calling thread. A reader
+// thread formats the records to stdout and stderr.
+// Format strings must be literals. %s arguments must also be literals as only
+// the pointer is recorded. At most RF24_LOG_ARGS arguments are kept.
+
+#if defined(DEBUG) && !defined(ARDUINO)
+
+#include "rf24time.hpp"
+#include <string.h>
+
+#define RF24_LOG_ARGS 4
+#define RF24_LOG_RECORDS 1024 // per thread, must be a power of 2
+#define RF24_LOG_DRAIN_MS 100 // reader thread interval
+
+#define DPRINT(x,...) rf24log_write(RF24LogRecord::debug, x, ##__VA_ARGS__)
+#define EPRINT(x,...) rf24log_write(RF24LogRecord::error, x, ##__VA_ARGS__)
+
+struct RF24LogRecord{
+  enum Level{debug, error} ;
+  const char *fmt ; // format string is the format ID
+  uint32_t timestamp ; // micro seconds, see rf24_micros()
+  uint8_t level ;
+  uint8_t nargs ;
+  uint64_t args[RF24_LOG_ARGS] ;
+};
+
+// Reserve a record in the calling thread's ring. Returns NULL and counts a
+// drop if the ring is full
+RF24LogRecord *rf24log_reserve() ;
+// Publish a record returned from rf24log_reserve
+void rf24log_commit() ;
+
+// Format all waiting records from every thread. Debug records go to out
+// and errors to err. Returns number of records written
+uint32_t rf24log_drain(FILE *out, FILE *err) ;
+// Records dropped because a ring was full
+uint32_t rf24log_dropped() ;
+// The reader thread starts with the first record. Call to stop it and
+// drain any remaining records
+void rf24log_stop() ;
+
+// Arguments are widened to 64 bits. Signed values are sign extended
+inline uint64_t rf24log_arg(int v){return (uint64_t)(int64_t)v;}
+inline uint64_t rf24log_arg(unsigned int v){return v;}
+inline uint64_t rf24log_arg(long v){return (uint64_t)(int64_t)v;}
+inline uint64_t rf24log_arg(unsigned long v){return v;}
+inline uint64_t rf24log_arg(long long v){return (uint64_t)v;}
+inline uint64_t rf24log_arg(unsigned long long v){return v;}
+inline uint64_t rf24log_arg(double v){uint64_t u; memcpy(&u, &v, sizeof(u)); return u;}
+inline uint64_t rf24log_arg(const void *v){return (uintptr_t)v;}
+
+inline void rf24log_args(RF24LogRecord *rec){}
+
+template<typename T, typename... Args>
+inline void rf24log_args(RF24LogRecord *rec, T val, Args... rest)
+{
+  if (rec->nargs < RF24_LOG_ARGS) rec->args[rec->nargs++] = rf24log_arg(val) ;
+  rf24log_args(rec, rest...) ;
+}
+
+template<typename... Args>
+inline void rf24log_write(RF24LogRecord::Level level, const char *fmt, Args... args)
+{
+  RF24LogRecord *rec = rf24log_reserve() ;
+  if (!rec) return ;
+  rec->fmt = fmt ;
+  rec->timestamp = rf24_micros() ;
+  rec->level = level ;
+  rec->nargs = 0 ;
+  rf24log_args(rec, args...) ;
+  rf24log_commit() ;
+}
+
+#elif defined(DEBUG)
+#define DPRINT(x,...) fprintf(stdout,x,##__VA_ARGS__)
+#define EPRINT(x,...) fprintf(stderr,x,##__VA_ARGS__)
+#else
+#define DPRINT(x,...)
+#define EPRINT(x,...)
+#endif
+
+#endif
@@ -0,0 +1,89 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_QUEUE
+#define __RF24_QUEUE
+
+#include <atomic>
+#include <stdint.h>
+
+// Bounded lock free queue. Any number of threads can push and pop.
+// Each cell holds a sequence number which tells a thread whether the cell
+// is ready to be written or read for its position, so the head and tail
+// are only claimed with a compare and swap. Items are copied in and out.
+// SIZE must be a power of 2
+template <class T, uint16_t SIZE>
+class RF24Queue{
+public:
+  static_assert(SIZE > 1 && (SIZE & (SIZE - 1)) == 0, "Queue size must be a power of 2") ;
+
+  RF24Queue(){
+    for (uint32_t i=0; i < SIZE; i++) m_cells[i].seq.store(i, std::memory_order_relaxed) ;
+    m_head.store(0, std::memory_order_relaxed) ;
+    m_tail.store(0, std::memory_order_relaxed) ;
+  }
+
+  // Returns false if the queue is full
+  bool push(const T &item){
+    Cell *cell ;
+    uint32_t pos = m_head.load(std::memory_order_relaxed) ;
+    for (;;){
+      cell = &m_cells[pos & (SIZE - 1)] ;
+      int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos) ;
+      if (diff == 0){
+	if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break ;
+      }else if (diff < 0) return false ; // cell not yet read from the last lap
+      else pos = m_head.load(std::memory_order_relaxed) ;
+    }
+    cell->data = item ;
+    cell->seq.store(pos + 1, std::memory_order_release) ;
+    return true ;
+  }
+
+  // Returns false if the queue is empty
+  bool pop(T &item){
+    Cell *cell ;
+    uint32_t pos = m_tail.load(std::memory_order_relaxed) ;
+    for (;;){
+      cell = &m_cells[pos & (SIZE - 1)] ;
+      int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - (pos + 1)) ;
+      if (diff == 0){
+	if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break ;
+      }else if (diff < 0) return false ; // cell not yet written
+      else pos = m_tail.load(std::memory_order_relaxed) ;
+    }
+    item = cell->data ;
+    cell->seq.store(pos + SIZE, std::memory_order_release) ;
+    return true ;
+  }
+
+  // Items queued. Only a snapshot while other threads are using the queue
+  uint32_t depth() const {
+    // Tail first as it never passes the head
+    uint32_t tail = m_tail.load(std::memory_order_acquire) ;
+    uint32_t head = m_head.load(std::memory_order_acquire) ;
+    return head - tail ;
+  }
+
+protected:
+  struct Cell{
+    std::atomic<uint32_t> seq ;
+    T data ;
+  };
+  Cell m_cells[SIZE] ;
+  std::atomic<uint32_t> m_head ; // next position to write
+  std::atomic<uint32_t> m_tail ; // next position to read
+};
+
+#endif
@@ -0,0 +1,267 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_REGISTERS
+#define __RF24_REGISTERS
+
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_RF24_ADDRESS_LEN 5
+#define MIN_RF24_ADDRESS_LEN 3
+#define MAX_RXTXBUF 32 // Changed from 33 to 32. Unsure why set 1 byte longer than acutally supported in hardware
+#define RF24_PIPES 6
+#define RF24_250KBPS 1
+#define RF24_1MBPS 2
+#define RF24_2MBPS 3
+#define RF24_NEG18DBM 0
+#define RF24_NEG12DBM 1
+#define RF24_NEG6DBM 2
+#define RF24_0DBM 3
+#define RF24_PIPE_EMPTY 0x07
+
+//Registers
+#define REG_CONFIG 0x00
+#define REG_EN_AA 0x01
+#define REG_EN_RXADDR 0x02
+#define REG_SETUP_AW 0x03
+#define REG_SETUP_RETR 0x04
+#define REG_RF_CH 0x05
+#define REG_RF_SETUP 0x06
+#define REG_STATUS 0x07
+#define REG_OBSERVE_TX 0x08
+#define REG_CD 0x09
+#define REG_RX_ADDR_BASE 0x0A
+#define REG_TX_ADDR 0x10
+#define REG_RX_PW_BASE 0x11
+#define REG_FIFO_STATUS 0x17
+#define REG_DYNPD 0x1C
+#define REG_FEATURE 0x1D
+// Size of the register map. 0x18 to 0x1B are reserved
+#define RF24_REGISTERS (REG_FEATURE+1)
+
+// In memory copy of the complete register map. reg holds the first byte
+// of every register. The full 5 byte address registers are held separately
+// with the LSB first as sent over SPI. Accessors decode fields in the same
+// way as the NordicRF24 GET calls without touching the hardware.
+// This is a literal type so fixed profiles can be built at compile time.
+struct RF24Registers{
+  uint8_t reg[RF24_REGISTERS] ;
+  uint8_t rx_addr0[MAX_RF24_ADDRESS_LEN] ;
+  uint8_t rx_addr1[MAX_RF24_ADDRESS_LEN] ;
+  uint8_t tx_addr[MAX_RF24_ADDRESS_LEN] ;
+
+  static constexpr bool is_reserved(uint8_t addr){return addr > REG_FIFO_STATUS && addr < REG_DYNPD;}
+  // Status registers change without being written
+  static constexpr bool is_volatile(uint8_t addr){return addr == REG_STATUS || addr == REG_OBSERVE_TX || addr == REG_CD || addr == REG_FIFO_STATUS;}
+  static constexpr bool is_address(uint8_t addr){return addr == REG_RX_ADDR_BASE || addr == REG_RX_ADDR_BASE+1 || addr == REG_TX_ADDR;}
+  // Multi-byte buffer for an address register or NULL
+  uint8_t *address(uint8_t addr){
+    return addr == REG_RX_ADDR_BASE?rx_addr0:addr == REG_RX_ADDR_BASE+1?rx_addr1:addr == REG_TX_ADDR?tx_addr:NULL;}
+  const uint8_t *address(uint8_t addr) const {return const_cast<RF24Registers*>(this)->address(addr);}
+
+  // Config register
+  constexpr bool use_interrupt_data_ready() const {return !(reg[REG_CONFIG] & 0x40);}
+  constexpr bool use_interrupt_data_sent() const {return !(reg[REG_CONFIG] & 0x20);}
+  constexpr bool use_interrupt_max_retry() const {return !(reg[REG_CONFIG] & 0x10);}
+  constexpr bool is_crc_enabled() const {return reg[REG_CONFIG] & 0x08;}
+  constexpr bool is_2_byte_crc() const {return reg[REG_CONFIG] & 0x04;}
+  constexpr bool is_powered_up() const {return reg[REG_CONFIG] & 0x02;}
+  constexpr bool is_receiver() const {return reg[REG_CONFIG] & 0x01;}
+  // Pipe registers
+  constexpr bool is_pipe_ack(uint8_t pipe) const {return reg[REG_EN_AA] & (1 << pipe);}
+  constexpr bool is_pipe_enabled(uint8_t pipe) const {return reg[REG_EN_RXADDR] & (1 << pipe);}
+  constexpr bool is_dynamic_payload(uint8_t pipe) const {return reg[REG_DYNPD] & (1 << pipe);}
+  constexpr uint8_t get_payload_width(uint8_t pipe) const {return reg[REG_RX_PW_BASE+pipe] & 0x3F;}
+  // Address, retry and channel registers
+  constexpr uint8_t get_address_width() const {return (reg[REG_SETUP_AW] & 0x03) + 2;}
+  constexpr uint8_t get_retry_delay() const {return reg[REG_SETUP_RETR] >> 4;}
+  constexpr uint8_t get_retry_count() const {return reg[REG_SETUP_RETR] & 0x0F;}
+  constexpr uint8_t get_channel() const {return reg[REG_RF_CH] & 0x7F;}
+  // Setup register
+  constexpr bool is_continuous_carrier_transmit() const {return reg[REG_RF_SETUP] & 0x80;}
+  constexpr uint8_t get_power_level() const {return (reg[REG_RF_SETUP] & 0x06) >> 1;}
+  constexpr uint8_t get_data_rate() const {
+    return (reg[REG_RF_SETUP] & 0x20)?RF24_250KBPS:(reg[REG_RF_SETUP] & 0x08)?RF24_2MBPS:RF24_1MBPS;}
+  // Status, observe and carrier detect registers
+  constexpr uint8_t get_pipe_available() const {return (reg[REG_STATUS] >> 1) & 0x07;}
+  constexpr bool has_received_data() const {return reg[REG_STATUS] & 0x40;}
+  constexpr bool has_data_sent() const {return reg[REG_STATUS] & 0x20;}
+  constexpr bool is_at_max_retry_limit() const {return reg[REG_STATUS] & 0x10;}
+  constexpr uint8_t get_packets_lost() const {return reg[REG_OBSERVE_TX] >> 4;}
+  constexpr uint8_t get_retransmitted() const {return reg[REG_OBSERVE_TX] & 0x0F;}
+  constexpr bool carrier_detect() const {return reg[REG_CD] & 0x01;}
+  // FIFO status register
+  constexpr bool is_rx_empty() const {return reg[REG_FIFO_STATUS] & 0x01;}
+  constexpr bool is_rx_full() const {return reg[REG_FIFO_STATUS] & 0x02;}
+  constexpr bool is_tx_empty() const {return reg[REG_FIFO_STATUS] & 0x10;}
+  constexpr bool is_tx_full() const {return reg[REG_FIFO_STATUS] & 0x20;}
+  constexpr bool is_tx_reuse() const {return reg[REG_FIFO_STATUS] & 0x40;}
+  // Feature register
+  constexpr bool dynamic_payloads_enabled() const {return reg[REG_FEATURE] & 0x04;}
+  constexpr bool payload_ack_enabled() const {return reg[REG_FEATURE] & 0x02;}
+  constexpr bool tx_noack_cmd_enabled() const {return reg[REG_FEATURE] & 0x01;}
+
+  // Copies the address width bytes of a pipe address. Pipes 2 to 5 share
+  // the MSBs of pipe 1
+  void get_rx_address(uint8_t pipe, uint8_t *addr) const {
+    memcpy(addr, pipe == 0?rx_addr0:rx_addr1, get_address_width()) ;
+    if (pipe > 1) addr[0] = reg[REG_RX_ADDR_BASE+pipe] ;
+  }
+};
+
+// Register values written by NordicRF24::reset_rf24. The class attributes
+// are decoded from the same image by reset_class so the two cannot disagree.
+// STATUS and FIFO_STATUS hold the power on values and are never written.
+constexpr RF24Registers rf24_reset_registers = {
+  {0x08, // CONFIG: CRC enabled, all interrupts, powered down
+   0x3F, // EN_AA: auto ack on all pipes
+   0x03, // EN_RXADDR: pipes 0 and 1
+   0x03, // SETUP_AW: 5 byte addresses
+   0x03, // SETUP_RETR: 250us, 3 retries
+   0x02, // RF_CH
+   0x06, // RF_SETUP: 1Mbps, 0dBm
+   0x0E, // STATUS
+   0x00, 0x00, // OBSERVE_TX, CD
+   0xE7, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, // RX_ADDR_P0 to P5
+   0xE7, // TX_ADDR
+   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // RX_PW_P0 to P5
+   0x11, // FIFO_STATUS: both FIFOs empty
+   0x00, 0x00, 0x00, 0x00, // reserved
+   0x00, 0x00}, // DYNPD, FEATURE
+  {0xE7, 0xE7, 0xE7, 0xE7, 0xE7},
+  {0xC2, 0xC2, 0xC2, 0xC2, 0xC2},
+  {0xE7, 0xE7, 0xE7, 0xE7, 0xE7}} ;
+
+static_assert(rf24_reset_registers.get_address_width() == MAX_RF24_ADDRESS_LEN &&
+	      rf24_reset_registers.is_crc_enabled() &&
+	      !rf24_reset_registers.is_powered_up(), "Invalid reset register image") ;
+
+struct RF24PipeConfig{
+  bool enabled ;
+  bool ack ;
+  bool dynamic_payload ;
+  uint8_t width ; // static payload width
+  uint8_t address[MAX_RF24_ADDRESS_LEN] ; // LSB first. Pipes 2 to 5 only use the LSB
+};
+
+// Complete radio configuration held as a value. Defaults are decoded from
+// rf24_reset_registers. Pass to NordicRF24::apply to write only the
+// registers which differ from the hardware. Power and receiver mode are not
+// part of the configuration and are left unchanged.
+struct RadioConfig{
+  bool interrupt_data_ready ;
+  bool interrupt_data_sent ;
+  bool interrupt_max_retry ;
+  bool crc ;
+  bool crc_2byte ;
+  uint8_t address_width ; // 3 to 5 bytes
+  uint8_t retry_delay ; // multiples of 250us, 0 to 15
+  uint8_t retry_count ; // 0 to 15
+  uint8_t channel ; // 0 to 125
+  uint8_t data_rate ; // RF24_250KBPS, RF24_1MBPS or RF24_2MBPS
+  uint8_t power_level ; // RF24_NEG18DBM to RF24_0DBM
+  bool dynamic_payloads ;
+  bool payload_ack ;
+  bool tx_noack ;
+  RF24PipeConfig pipe[RF24_PIPES] ;
+  uint8_t tx_address[MAX_RF24_ADDRESS_LEN] ;
+  uint8_t transmit_width ;
+
+  RadioConfig(){decode(rf24_reset_registers);}
+  explicit RadioConfig(const RF24Registers &regs){decode(regs);}
+
+  // Read the configuration from a register image
+  void decode(const RF24Registers &regs){
+    interrupt_data_ready = regs.use_interrupt_data_ready() ;
+    interrupt_data_sent = regs.use_interrupt_data_sent() ;
+    interrupt_max_retry = regs.use_interrupt_max_retry() ;
+    crc = regs.is_crc_enabled() ;
+    crc_2byte = regs.is_2_byte_crc() ;
+    address_width = regs.get_address_width() ;
+    retry_delay = regs.get_retry_delay() ;
+    retry_count = regs.get_retry_count() ;
+    channel = regs.get_channel() ;
+    data_rate = regs.get_data_rate() ;
+    power_level = regs.get_power_level() ;
+    dynamic_payloads = regs.dynamic_payloads_enabled() ;
+    payload_ack = regs.payload_ack_enabled() ;
+    tx_noack = regs.tx_noack_cmd_enabled() ;
+    for (uint8_t i=0; i < RF24_PIPES; i++){
+      pipe[i].enabled = regs.is_pipe_enabled(i) ;
+      pipe[i].ack = regs.is_pipe_ack(i) ;
+      pipe[i].dynamic_payload = regs.is_dynamic_payload(i) ;
+      pipe[i].width = regs.get_payload_width(i) ;
+      memset(pipe[i].address, 0, MAX_RF24_ADDRESS_LEN) ;
+      regs.get_rx_address(i, pipe[i].address) ;
+    }
+    memcpy(tx_address, regs.tx_addr, MAX_RF24_ADDRESS_LEN) ;
+    transmit_width = MAX_RXTXBUF ;
+  }
+
+  // Copy address_width bytes of an address. Only the LSB is used for pipes 2 to 5
+  bool set_rx_address(uint8_t p, const uint8_t *address){
+    if (p >= RF24_PIPES || address_width > MAX_RF24_ADDRESS_LEN) return false ;
+    memcpy(pipe[p].address, address, p > 1?1:address_width) ;
+    return true ;
+  }
+  bool set_tx_address(const uint8_t *address){
+    if (address_width > MAX_RF24_ADDRESS_LEN) return false ;
+    memcpy(tx_address, address, address_width) ;
+    return true ;
+  }
+
+  // Returns false if a value is out of range for the hardware
+  bool is_valid() const {
+    if (address_width < MIN_RF24_ADDRESS_LEN || address_width > MAX_RF24_ADDRESS_LEN) return false ;
+    if (retry_delay > 0x0F || retry_count > 0x0F || channel > 125) return false ;
+    if (data_rate < RF24_250KBPS || data_rate > RF24_2MBPS || power_level > RF24_0DBM) return false ;
+    if (transmit_width > MAX_RXTXBUF) return false ;
+    for (uint8_t i=0; i < RF24_PIPES; i++)
+      if (pipe[i].width > MAX_RXTXBUF) return false ;
+    return true ;
+  }
+
+  // Write the configuration into a register image. The PWR_UP and PRIM_RX
+  // bits of CONFIG are kept from the image
+  void encode(RF24Registers &regs) const {
+    uint8_t aa = 0, rxaddr = 0, dynpd = 0 ;
+    regs.reg[REG_CONFIG] = (regs.reg[REG_CONFIG] & 0x03) |
+      (interrupt_data_ready?0:0x40) | (interrupt_data_sent?0:0x20) |
+      (interrupt_max_retry?0:0x10) | (crc?0x08:0) | (crc_2byte?0x04:0) ;
+    for (uint8_t i=0; i < RF24_PIPES; i++){
+      if (pipe[i].ack) aa |= 1 << i ;
+      if (pipe[i].enabled) rxaddr |= 1 << i ;
+      if (pipe[i].dynamic_payload) dynpd |= 1 << i ;
+      regs.reg[REG_RX_PW_BASE+i] = pipe[i].width ;
+      uint8_t *full = regs.address(REG_RX_ADDR_BASE+i) ;
+      if (full) memcpy(full, pipe[i].address, MAX_RF24_ADDRESS_LEN) ;
+      regs.reg[REG_RX_ADDR_BASE+i] = pipe[i].address[0] ;
+    }
+    regs.reg[REG_EN_AA] = aa ;
+    regs.reg[REG_EN_RXADDR] = rxaddr ;
+    regs.reg[REG_DYNPD] = dynpd ;
+    regs.reg[REG_SETUP_AW] = address_width - 2 ;
+    regs.reg[REG_SETUP_RETR] = (retry_delay << 4) | retry_count ;
+    regs.reg[REG_RF_CH] = channel ;
+    // Continuous carrier and PLL lock are test modes and always cleared
+    regs.reg[REG_RF_SETUP] = (data_rate == RF24_250KBPS?0x20:0) |
+      (data_rate == RF24_2MBPS?0x08:0) | (power_level << 1) ;
+    memcpy(regs.tx_addr, tx_address, MAX_RF24_ADDRESS_LEN) ;
+    regs.reg[REG_TX_ADDR] = tx_address[0] ;
+    regs.reg[REG_FEATURE] = (dynamic_payloads?0x04:0) | (payload_ack?0x02:0) | (tx_noack?0x01:0) ;
+  }
+};
+
+#endif
@@ -0,0 +1,98 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_SPI_BATCH
+#define __RF24_SPI_BATCH
+
+#include <stdint.h>
+
+// Queue limits for a batch of SPI frames
+#define RF24_BATCH_FRAMES 32
+#define RF24_BATCH_BYTES 128
+
+// Backend which clocks several SPI frames in one call. Each frame is a
+// separate chip select. Frames are held back to back in buf and lens has the
+// length of each. Data clocked in replaces the frame data in buf.
+// NordicRF24 sends frames one at a time through IHardwareSPI if no batch
+// backend is set
+class IRF24SpiBatch{
+public:
+  virtual ~IRF24SpiBatch(){}
+  virtual bool transfer(uint8_t *buf, const uint8_t *lens, uint8_t count) = 0 ;
+};
+
+#if !defined(ARDUINO) && defined(__linux__)
+
+#include <linux/spi/spidev.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+// spidev backend submitting a batch as one SPI_IOC_MESSAGE ioctl.
+// Opens its own descriptor to the device used by the IHardwareSPI instance.
+// Frames sent through this backend are not seen by wrappers such as SPITrace
+class RF24SpidevBatch : public IRF24SpiBatch{
+public:
+  RF24SpidevBatch(){m_fd = -1; m_speed = 0;}
+  ~RF24SpidevBatch(){close();}
+
+  // Open /dev/spidev<bus>.<cs> in SPI mode 0
+  bool open(int bus, int cs, uint32_t speed_hz){
+    char dev[32] ;
+    uint8_t mode = SPI_MODE_0 ;
+    close() ;
+    snprintf(dev, sizeof(dev), "/dev/spidev%d.%d", bus, cs) ;
+    m_fd = ::open(dev, O_RDWR) ;
+    if (m_fd < 0) return false ;
+    if (ioctl(m_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+	ioctl(m_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0){
+      close() ;
+      return false ;
+    }
+    m_speed = speed_hz ;
+    return true ;
+  }
+
+  void close(){
+    if (m_fd >= 0) ::close(m_fd) ;
+    m_fd = -1 ;
+  }
+
+  bool transfer(uint8_t *buf, const uint8_t *lens, uint8_t count){
+    struct spi_ioc_transfer xfer[RF24_BATCH_FRAMES] ;
+    if (m_fd < 0 || count == 0 || count > RF24_BATCH_FRAMES) return false ;
+    memset(xfer, 0, sizeof(xfer[0]) * count) ;
+    for (uint8_t i=0; i < count; i++){
+      xfer[i].tx_buf = (unsigned long)buf ;
+      xfer[i].rx_buf = (unsigned long)buf ;
+      xfer[i].len = lens[i] ;
+      xfer[i].speed_hz = m_speed ;
+      xfer[i].bits_per_word = 8 ;
+      // Release chip select between frames as each is a new command
+      xfer[i].cs_change = (i + 1 < count)?1:0 ;
+      buf += lens[i] ;
+    }
+    return ioctl(m_fd, SPI_IOC_MESSAGE(count), xfer) >= 0 ;
+  }
+
+protected:
+  int m_fd ;
+  uint32_t m_speed ;
+};
+
+#endif
+
+#endif
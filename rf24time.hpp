@@ -0,0 +1,94 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_TIME
+#define __RF24_TIME
+
+#include <stdint.h>
+#ifdef ARDUINO
+ #include <Arduino.h>
+#else
+ #include <time.h>
+ #include <algorithm>
+#endif
+
+// Monotonic micro second clock used for timestamps and latency measurement.
+// Value wraps after about 71 minutes so always compare using unsigned subtraction
+inline uint32_t rf24_micros()
+{
+#ifdef ARDUINO
+  return micros() ;
+#else
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000) ;
+#endif
+}
+
+#ifndef ARDUINO
+// Number of short sleeps timed when calibrating and the length of each
+#define RF24_DELAY_CALIBRATE_RUNS 20
+#define RF24_DELAY_CALIBRATE_US 50
+
+inline uint64_t rf24_nanos()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+}
+
+// Time how far nanosleep overruns a short request. Uses the 90th percentile
+// so a single scheduling spike doesn't turn every delay into a spin
+inline uint32_t rf24_calibrate_sleep()
+{
+  uint64_t over[RF24_DELAY_CALIBRATE_RUNS] ;
+  struct timespec req = {0, RF24_DELAY_CALIBRATE_US * 1000} ;
+  for (int i=0; i < RF24_DELAY_CALIBRATE_RUNS; i++){
+    uint64_t start = rf24_nanos() ;
+    nanosleep(&req, NULL) ;
+    uint64_t elapsed = rf24_nanos() - start ;
+    over[i] = elapsed > (uint64_t)req.tv_nsec?elapsed - req.tv_nsec:0 ;
+  }
+  std::sort(over, over + RF24_DELAY_CALIBRATE_RUNS) ;
+  return (uint32_t)(over[RF24_DELAY_CALIBRATE_RUNS * 9 / 10] / 1000) + 1 ;
+}
+
+// Sleep overshoot in micro seconds. Calibrated once on the first call,
+// which takes a few milli seconds. NordicRF24 calls it when constructed
+inline uint32_t rf24_sleep_overshoot()
+{
+  static uint32_t overshoot = rf24_calibrate_sleep() ;
+  return overshoot ;
+}
+
+// Precise delay. Sleeps for the part of the interval longer than the
+// calibrated overshoot and spins on the monotonic clock for the rest.
+// Returns the nano seconds actually waited
+inline uint64_t rf24_delay_us(uint32_t us)
+{
+  uint64_t start = rf24_nanos(), now = start ;
+  uint64_t end = start + (uint64_t)us * 1000 ;
+  uint32_t overshoot = rf24_sleep_overshoot() ;
+
+  if (us > overshoot){
+    uint32_t sleep_us = us - overshoot ;
+    struct timespec req = {(time_t)(sleep_us / 1000000), (long)(sleep_us % 1000000) * 1000} ;
+    nanosleep(&req, NULL) ;
+  }
+  while ((now = rf24_nanos()) < end) ;
+  return now - start ;
+}
+#endif
+
+#endif
@@ -20,19 +20,64 @@
  #include <pthread.h>
 #endif
 #include <string.h>
+#include "rf24registers.hpp"
+#include "rf24bus.hpp"
+#include "rf24spibatch.hpp"
+#include "rf24atomic.hpp"
+
+// Instrumentation counters are plain increments held in each instance.
+// Excluded from Arduino builds unless RF24_STATS is defined to save RAM
+#if defined(ARDUINO) && !defined(RF24_STATS)
+ #define RF24_NO_STATS
+#endif
+#ifdef RF24_NO_STATS
+ #define STAT_INC(x)
+ #define STAT_ADD(x,n)
+#else
+ #define STAT_INC(x) m_stats.x++
+ #define STAT_ADD(x,n) m_stats.x += (n)
+#endif
 
-#define MAX_RF24_ADDRESS_LEN 5
-#define MIN_RF24_ADDRESS_LEN 3
-#define MAX_RXTXBUF 32 // Changed from 33 to 32. Unsure why set 1 byte longer than acutally supported in hardware 
-#define RF24_PIPES 6
-#define RF24_250KBPS 1
-#define RF24_1MBPS 2
-#define RF24_2MBPS 3
-#define RF24_NEG18DBM 0
-#define RF24_NEG12DBM 1
-#define RF24_NEG6DBM 2
-#define RF24_0DBM 3
-#define RF24_PIPE_EMPTY 0x07
+// Histogram buckets. Bucket i counts values below 2^i micro seconds,
+// the last bucket counts everything larger
+#define RF24_HIST_BUCKETS 20
+
+// SPI command classes counted in RF24Stats::spi_cmd
+enum RF24SpiCmd{spi_r_register, spi_w_register, spi_r_rx_payload,
+		spi_w_tx_payload, spi_flush_tx, spi_flush_rx,
+		spi_r_rx_pl_wid, spi_other, spi_cmd_count} ;
+
+struct RF24Stats{
+  uint32_t spi_cmd[spi_cmd_count] ; // transactions by command type
+  uint32_t spi_bytes ; // bytes clocked including command bytes
+  uint32_t irqs ; // interrupt handler calls
+  uint32_t rx_payloads ; // payloads read from RX FIFO
+  uint32_t rx_fifo_full ; // times RX FIFO was seen to become full
+  uint32_t tx_fifo_full ; // times TX FIFO was seen to become full
+  uint32_t flush_tx ;
+  uint32_t flush_rx ;
+  uint32_t max_rt ; // MAX_RT interrupts
+  uint32_t tx_ds ; // TX_DS interrupts
+  uint32_t tx_ds_latency[RF24_HIST_BUCKETS] ; // write_packet to TX_DS in us
+  uint64_t tx_ds_latency_us ; // total of the latencies in the histogram
+  uint32_t lock_count ; // m_rwlock acquisitions
+  uint64_t lock_wait_us ; // total time waiting for m_rwlock
+  uint64_t lock_hold_us ; // total time holding m_rwlock
+  uint32_t lock_hold_max_us ;
+  uint32_t lock_hold[RF24_HIST_BUCKETS] ; // hold time histogram in us
+  uint32_t delay_count ; // calls to delay_us
+  uint64_t delay_error_ns ; // total time waited beyond the request
+  uint32_t delay_error_max_ns ;
+};
+
+// Radio operating states tracked by the driver classes. A settling state
+// reports as the settled state once its deadline has passed.
+// rf24_tx is a transmitter ready to pulse CE or sending
+enum RF24State{rf24_power_down, rf24_standby, rf24_rx_settling, rf24_rx,
+	       rf24_tx_settling, rf24_tx} ;
+
+// Settling time after a mode change before the radio is usable
+#define RF24_SETTLE_US 130
 
 #define AR_CONFIG if(m_auto_update)read_config()
 #define AW_CONFIG if(m_auto_update)write_config()
@@ -40,21 +85,45 @@
 #define AR_FEAT if(m_auto_update)read_feature()
 #define AW_FEAT if(m_auto_update)write_feature()
 
-class NordicRF24{
+#ifndef ARDUINO
+  extern pthread_mutex_t m_rwlock ;
+#endif
+
+// Register level driver. SPI, GPIO and Timer are the hardware backend
+// types. NordicRF24 below uses the IHardwareSPI, IHardwareGPIO and
+// IHardwareTimer interfaces so every hardware call is virtual.
+// Instantiating with concrete backend classes lets the compiler call and
+// inline them directly on the register and payload paths. Mark the
+// backend classes final, otherwise calls through the pointers can still
+// be virtual. Member functions are defined in rpinrf24.ipp
+template <class SPI, class GPIO, class Timer>
+class NordicRF24T : public RF24Bus<SPI, GPIO, Timer>{
+  typedef RF24Bus<SPI, GPIO, Timer> Bus ;
 public:
-  NordicRF24();
-  ~NordicRF24() ;
+  NordicRF24T();
+  ~NordicRF24T() ;
+  using Bus::spi_transfer ;
+  using Bus::spi_command ;
+  using Bus::ce_output ;
+  using Bus::pulse_ce ;
   // Full hardware reset to defaults and
   // reset of class attributes to reflect this
   bool reset_rf24() ;
-  bool set_spi(IHardwareSPI *pSPI);
+  bool set_spi(SPI *pSPI);
   
-  bool set_timer(IHardwareTimer *pTimer) ;
+  bool set_timer(Timer *pTimer) ;
+
+#ifndef ARDUINO
+  // Backend which sends several SPI frames in one call, such as
+  // RF24SpidevBatch. Without one batched frames are sent one at a time.
+  // Set to NULL to remove
+  bool set_spi_batch(IRF24SpiBatch *pBatch) ;
+#endif
 
   void auto_update(bool update){m_auto_update = update;}
 
   // Set the GPIO interface. GPIO will be configured
-  bool set_gpio(IHardwareGPIO *pGPIO, uint8_t ce, uint8_t irq) ;
+  bool set_gpio(GPIO *pGPIO, uint8_t ce, uint8_t irq) ;
 
   // Writes a packet of data. packet must match the tx packet size!
   // Returns 0 if data cannot be written otherwise the packet length
@@ -75,21 +144,22 @@ public:
   bool read_config();
   bool write_config();
   // GET calls
-  bool use_interrupt_data_ready(){AR_CONFIG;return m_mask_rx_dr;}
-  bool use_interrupt_data_sent(){AR_CONFIG;return m_mask_tx_ds;}
-  bool use_interrupt_max_retry(){AR_CONFIG;return m_mask_max_rt;}
-  bool is_crc_enabled(){AR_CONFIG;return m_en_crc;}
-  bool is_powered_up(){AR_CONFIG;return m_pwr_up;}
-  bool is_receiver(){AR_CONFIG;return m_prim_rx;}
-  bool is_2_byte_crc(){AR_CONFIG;return m_crc_2byte;}
+  // Interrupts are used when the MASK bit is clear
+  bool use_interrupt_data_ready(){AR_CONFIG;return !reg_bit(m_reg_config, 6);}
+  bool use_interrupt_data_sent(){AR_CONFIG;return !reg_bit(m_reg_config, 5);}
+  bool use_interrupt_max_retry(){AR_CONFIG;return !reg_bit(m_reg_config, 4);}
+  bool is_crc_enabled(){AR_CONFIG;return reg_bit(m_reg_config, 3);}
+  bool is_powered_up(){AR_CONFIG;return reg_bit(m_reg_config, 1);}
+  bool is_receiver(){AR_CONFIG;return reg_bit(m_reg_config, 0);}
+  bool is_2_byte_crc(){AR_CONFIG;return reg_bit(m_reg_config, 2);}
   // SET calls
-  void set_use_interrupt_data_ready(bool set){m_mask_rx_dr = set;AW_CONFIG;}
-  void set_use_interrupt_data_sent(bool set){m_mask_tx_ds = set;AW_CONFIG;}
-  void set_use_interrupt_max_retry(bool set){m_mask_max_rt = set;AW_CONFIG;}
-  void crc_enabled(bool set){m_en_crc = set;AW_CONFIG;}
-  void set_2_byte_crc(bool set){m_crc_2byte = set;AW_CONFIG;}
-  void power_up(bool set){m_pwr_up = set;AW_CONFIG;}
-  void receiver(bool set){m_prim_rx = set;AW_CONFIG;}
+  void set_use_interrupt_data_ready(bool set){set_reg_bit(m_reg_config, 6, !set);AW_CONFIG;}
+  void set_use_interrupt_data_sent(bool set){set_reg_bit(m_reg_config, 5, !set);AW_CONFIG;}
+  void set_use_interrupt_max_retry(bool set){set_reg_bit(m_reg_config, 4, !set);AW_CONFIG;}
+  void crc_enabled(bool set){set_reg_bit(m_reg_config, 3, set);AW_CONFIG;}
+  void set_2_byte_crc(bool set){set_reg_bit(m_reg_config, 2, set);AW_CONFIG;}
+  void power_up(bool set){set_reg_bit(m_reg_config, 1, set);AW_CONFIG;}
+  void receiver(bool set){set_reg_bit(m_reg_config, 0, set);AW_CONFIG;}
 
   // Enable Auto Acknowledgement settings
   bool read_enaa() ;
@@ -194,11 +264,11 @@ public:
   // Fifo-status register
   bool read_fifo_status() ;
   // GET calls
-  bool is_rx_empty(){AR_FIFO;return m_rx_empty;}
-  bool is_rx_full(){AR_FIFO;return m_rx_full;}
-  bool is_tx_empty(){AR_FIFO;return m_tx_empty;}
-  bool is_tx_full(){AR_FIFO;return m_tx_full;}
-  bool is_tx_reuse(){AR_FIFO;return m_tx_reuse;}
+  bool is_rx_empty(){AR_FIFO;return reg_bit(m_reg_fifo, 0);}
+  bool is_rx_full(){AR_FIFO;return reg_bit(m_reg_fifo, 1);}
+  bool is_tx_empty(){AR_FIFO;return reg_bit(m_reg_fifo, 4);}
+  bool is_tx_full(){AR_FIFO;return reg_bit(m_reg_fifo, 5);}
+  bool is_tx_reuse(){AR_FIFO;return reg_bit(m_reg_fifo, 6);}
 
   // DYNPD register
   bool read_dynamic_payload() ;
@@ -212,90 +282,161 @@ public:
   bool read_feature() ;
   bool write_feature() ;
   // GET calls
-  bool dynamic_payloads_enabled(){AR_FEAT;return m_en_dyn_payload;}
-  bool payload_ack_enabled(){AR_FEAT;return m_en_ack_payload ;}
-  bool tx_noack_cmd_enabled(){AR_FEAT;return m_en_dyn_ack;}
+  bool dynamic_payloads_enabled(){AR_FEAT;return reg_bit(m_reg_feature, 2);}
+  bool payload_ack_enabled(){AR_FEAT;return reg_bit(m_reg_feature, 1);}
+  bool tx_noack_cmd_enabled(){AR_FEAT;return reg_bit(m_reg_feature, 0);}
   // SET calls
-  void set_dynamic_payloads(bool enable){m_en_dyn_payload=enable;AW_FEAT;}
-  void set_payload_ack(bool enable){m_en_ack_payload=enable;AW_FEAT;}
-  void set_tx_noack_cmd(bool enable){m_en_dyn_ack=enable;AW_FEAT;}
+  void set_dynamic_payloads(bool enable){set_reg_bit(m_reg_feature, 2, enable);AW_FEAT;}
+  void set_payload_ack(bool enable){set_reg_bit(m_reg_feature, 1, enable);AW_FEAT;}
+  void set_tx_noack_cmd(bool enable){set_reg_bit(m_reg_feature, 0, enable);AW_FEAT;}
 
   bool flushtx();
   bool flushrx();
+
+  // Read the complete register map in one pass (one SPI transaction per
+  // register) and update the cached class attributes to match
+  bool read_registers(RF24Registers &regs) ;
+
+  // Write a complete configuration. Only registers which differ from the
+  // last value read from or written to the hardware are written.
+  // Returns false if the configuration is invalid or a write fails
+  bool apply(const RadioConfig &config) ;
+  // Write a register image such as a constexpr profile. Registers which
+  // match the known state are skipped unless force is set. The status
+  // registers in the image are ignored
+  bool write_registers(const RF24Registers &regs, bool force) ;
+
+  // Current operating state as recorded by the last mode change
+  RF24State get_state() ;
+  // Micro seconds until the last mode change has settled
+  uint32_t settle_remaining() ;
+  // Wait a short precise time. On Linux this sleeps for the bulk of the
+  // interval and spins for the rest. Arduino uses the timer interface
+  void delay_us(uint32_t us) ;
+  // Sleep until the last mode change has settled. Call without the
+  // driver lock held so the interrupt handler is not blocked
+  void wait_settled() ;
+
+  // Instrumentation. Copies the counters for this instance.
+  // Counters are not reset by reset_rf24
+  void get_stats(RF24Stats &stats) ;
+  void reset_stats() ;
+
 static void interrupt() ;
 protected:
+  using Bus::m_pSPI ;
+  using Bus::m_pGPIO ;
+  using Bus::m_pTimer ;
+  using Bus::m_ce ;
+  using Bus::m_spibuf ;
+  // Driver needs to be just one instance for interrupt handling
+  static volatile NordicRF24T *radio_singleton ;
   void reset_class() ;
+  // Take and release the driver mutex. Time held is recorded in the stats
+  void lock() ;
+  void unlock() ;
+#ifdef RF24_NO_STATS
+  void count_spi(uint8_t cmd, uint8_t len){}
+#else
+  void count_spi(uint8_t cmd, uint8_t len) ;
+  static void add_histogram(uint32_t *hist, uint32_t value) ;
+#endif
+  // Record a mode change which is usable after settle_us.
+  // Extending keeps the state and moves the deadline out if later
+  void set_state(RF24State state, uint32_t settle_us) ;
+  void extend_settle(uint32_t settle_us) ;
+  // Update interrupt counters from the last status read
+  void count_interrupt() ;
   bool read_register(uint8_t addr, uint8_t *val, uint8_t len);
   bool write_register(uint8_t addr, const uint8_t *val, uint8_t len);
+  // Queue SPI frames and send them together. Data clocked in after the
+  // STATUS byte is copied to rx (if not NULL) when submitted. Register
+  // reads and writes are tracked as for read_register and write_register.
+  // A full queue is submitted early. Arduino builds send each frame as it
+  // is added. Returns false if any transfer failed
+  void batch_begin() ;
+  bool batch_add(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) ;
+  bool batch_submit() ;
+  // Flush RX and clear the interrupt flags as one batch
+  bool end_interrupt() ;
+  // Record a register value seen on SPI as the known hardware state
+  void track_register(uint8_t addr, const uint8_t *val, uint8_t len) ;
+  bool is_known(uint8_t addr){return (m_known_valid & (1UL << addr)) != 0;}
   bool enable_features(bool enable) ; // Should this be public?
+  // Decode register values into the class attributes
   void convert_status(uint8_t status) ;
+  void convert_config(uint8_t reg) ;
+  void convert_enaa(uint8_t reg) ;
+  void convert_enrxaddr(uint8_t reg) ;
+  void convert_setup(uint8_t reg) ;
+  void convert_fifo_status(uint8_t reg) ;
+  void convert_dynamic_payload(uint8_t reg) ;
+  void convert_feature(uint8_t reg) ;
+  static bool reg_bit(uint8_t reg, uint8_t bit){return (reg >> bit) & 1;}
+  static void set_reg_bit(uint8_t &reg, uint8_t bit, bool set){
+    if (set) reg |= (1 << bit) ;
+    else reg &= ~(1 << bit) ;
+  }
   
   virtual bool max_retry_interrupt() ;
   virtual bool data_sent_interrupt() ;
   virtual bool data_received_interrupt() ;
 
-  IHardwareSPI *m_pSPI ;
-  IHardwareGPIO *m_pGPIO ;
-  IHardwareTimer *m_pTimer ;
-  uint8_t m_rxbuf[MAX_RXTXBUF+1], m_txbuf[MAX_RXTXBUF+1] ; // Add 1 for register information received and send over serial
-  uint8_t m_irq, m_ce;
+  uint8_t m_irq ;
+
+  bool m_batch_ok ;
+#ifndef ARDUINO
+  IRF24SpiBatch *m_pBatch ;
+  uint8_t m_batch_buf[RF24_BATCH_BYTES] ;
+  uint8_t m_batch_len[RF24_BATCH_FRAMES] ;
+  uint8_t m_batch_cmd[RF24_BATCH_FRAMES] ;
+  uint8_t *m_batch_rx[RF24_BATCH_FRAMES] ;
+  uint8_t m_batch_frames ;
+  uint16_t m_batch_bytes ;
+#endif
 
   bool m_auto_update ; 
   bool m_is_plus ; // Is this a plus model or standard?
   
-  // Config register
-  bool m_mask_rx_dr ;
-  bool m_mask_tx_ds ;
-  bool m_mask_max_rt ;
-  bool m_en_crc ;
-  bool m_crc_2byte ;
-  bool m_pwr_up ;
-  bool m_prim_rx ;
-
-  // Enable Auto Ack register
-  bool m_en_aa[RF24_PIPES] ;
-  bool m_enable_pipe[RF24_PIPES] ;
-
-  // Setup register
-  bool m_cont_wave ;
-  bool m_pll_lock ;
-  uint8_t m_data_rate ; // 4 levels
-  uint8_t m_rf_pwr ; // 4 levels
-
-  // Status register
-  bool m_tx_full;
-  uint8_t m_rx_pipe_ready ;
-  bool m_interrupt_max_rt ;
-  bool m_interrupt_tx_ds ;
-  bool m_interrupt_rx_dr ;
-
-  // FIFO register
-  bool m_tx_reuse ;
-  //bool m_tx_full ; // Same meaning as status register
-  bool m_tx_empty ;
-  bool m_rx_full ;
-  bool m_rx_empty ;
+  // Register values held as the raw bytes. Bits are tested and set
+  // with reg_bit and set_reg_bit
+  uint8_t m_reg_config ;
+  uint8_t m_reg_en_aa ;
+  uint8_t m_reg_en_rxaddr ;
+  uint8_t m_reg_setup ;
+  // STATUS is published for the status getters which don't take the lock
+  RF24Atomic<uint8_t> m_reg_status ;
+  uint8_t m_reg_fifo ;
+  uint8_t m_reg_dynpd ;
+  uint8_t m_reg_feature ;
 
-  // DYNPD register
-  bool m_dyn_payload[RF24_PIPES] ;
+  uint8_t m_transmit_width ;
 
-  // Feature register
-  bool m_en_dyn_payload ;
-  bool m_en_ack_payload ;
-  bool m_en_dyn_ack ;
+  // Mode state machine. Deadline is an rf24_micros timestamp
+  RF24Atomic<uint8_t> m_state ;
+  RF24Atomic<uint32_t> m_settle_deadline ;
 
-  //uint8_t m_read_buffer[];
+  // Last register values read from or written to the hardware.
+  // m_known_valid has a bit set for each register address held
+  RF24Registers m_known ;
+  uint32_t m_known_valid ;
 
-  uint8_t m_transmit_width ;
+#ifndef RF24_NO_STATS
+  RF24Stats m_stats ;
+  uint32_t m_tx_start ; // time of last write_packet
+  uint32_t m_lock_start ;
+#endif
 
 private:
 
 } ;
 
-volatile extern NordicRF24* radio_singleton ;
-#ifndef ARDUINO
-  extern pthread_mutex_t m_rwlock ;  
-#endif
+#include "rpinrf24.ipp"
+
+// Driver on the hardware interfaces, used by the other driver classes.
+// Prebuilt in rpinrf24.cpp
+extern template class NordicRF24T<IHardwareSPI, IHardwareGPIO, IHardwareTimer> ;
+typedef NordicRF24T<IHardwareSPI, IHardwareGPIO, IHardwareTimer> NordicRF24 ;
 
 
 #endif
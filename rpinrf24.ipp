@@ -0,0 +1,1291 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Member definitions of NordicRF24T. Included by rpinrf24.hpp so the
+// driver can be instantiated with any hardware backend
+#ifndef __NORDIC_RF24_IPP
+#define __NORDIC_RF24_IPP
+
+#include "rf24time.hpp"
+#include "rf24log.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _BV
+ #define _BV(x) 1 << x
+ #define RF24_LOCAL_BV
+#endif
+
+// Commands
+#define RF24_NOP 0xFF
+#define RF24_READ_REG 0x00
+#define RF24_WRITE_REG 0x20
+#define R_RX_PAYLOAD 0x61
+#define W_TX_PAYLOAD 0xA0
+#define FLUSH_TX 0xE1
+#define FLUSH_RX 0xE2
+#define REUSE_TX_PL 0xE3
+#define R_RX_PL_WID 0x60
+#define W_ACK_PAYLOAD 0xA8
+#define W_TX_PAYLOAD_NO_ACK 0xB0
+// Non-plus commands
+#define ACTIVATE 0x50
+#define ACTIVATE_FEATURES 0x73
+
+#define NORDIC_TEMPLATE template <class SPI, class GPIO, class Timer>
+#define NORDIC_CLASS NordicRF24T<SPI, GPIO, Timer>
+
+NORDIC_TEMPLATE
+volatile NORDIC_CLASS *NORDIC_CLASS::radio_singleton = NULL ;
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::interrupt()
+{
+  NordicRF24T *radio = (NordicRF24T *)radio_singleton ;
+  // SPI is shared with sending threads. The STATUS read is published so
+  // the checks below don't need the lock
+  radio->lock() ;
+  if (!radio->read_status()){
+    DPRINT("Failed to read status in interrupt handler\n") ;
+  }
+  radio->count_interrupt() ;
+  radio->unlock() ;
+
+  /*  
+  DPRINT("STATUS:\t\tReceived=%s, Transmitted=%s, Max Retry=%s, RX Pipe Ready=%d, Transmit Full=%s\n",
+	 radio->has_received_data()?"YES":"NO",
+	 radio->has_data_sent()?"YES":"NO",
+	 radio->is_at_max_retry_limit()?"YES":"NO",
+	 radio->get_pipe_available(),
+	 radio->is_transmit_full()?"YES":"NO"
+	 );
+  */  
+  if (radio->has_received_data()) radio->data_received_interrupt();
+    
+  if (radio->has_data_sent()) radio->data_sent_interrupt();
+    
+  if (radio->is_at_max_retry_limit()) radio->max_retry_interrupt();
+
+  radio->lock() ;
+  radio->end_interrupt() ;
+  radio->unlock() ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::lock()
+{
+#ifndef ARDUINO
+ #ifndef RF24_NO_STATS
+  uint32_t start = rf24_micros() ;
+  pthread_mutex_lock(&m_rwlock) ;
+  m_lock_start = rf24_micros() ;
+  m_stats.lock_count++ ;
+  m_stats.lock_wait_us += m_lock_start - start ;
+ #else
+  pthread_mutex_lock(&m_rwlock) ;
+ #endif
+#endif
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::unlock()
+{
+#ifndef ARDUINO
+ #ifndef RF24_NO_STATS
+  uint32_t held = rf24_micros() - m_lock_start ;
+  m_stats.lock_hold_us += held ;
+  if (held > m_stats.lock_hold_max_us) m_stats.lock_hold_max_us = held ;
+  add_histogram(m_stats.lock_hold, held) ;
+ #endif
+  pthread_mutex_unlock(&m_rwlock) ;
+#endif
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::count_interrupt()
+{
+#ifndef RF24_NO_STATS
+  m_stats.irqs++ ;
+  if (reg_bit(m_reg_status, 5)){
+    uint32_t latency = rf24_micros() - m_tx_start ;
+    m_stats.tx_ds++ ;
+    m_stats.tx_ds_latency_us += latency ;
+    add_histogram(m_stats.tx_ds_latency, latency) ;
+  }
+  if (reg_bit(m_reg_status, 4)) m_stats.max_rt++ ;
+#endif
+}
+
+#ifndef RF24_NO_STATS
+NORDIC_TEMPLATE
+void NORDIC_CLASS::count_spi(uint8_t cmd, uint8_t len)
+{
+  RF24SpiCmd type = spi_other ;
+  if (cmd < RF24_WRITE_REG) type = spi_r_register ;
+  else if (cmd < (RF24_WRITE_REG << 1)) type = spi_w_register ;
+  else{
+    switch(cmd){
+    case R_RX_PAYLOAD: type = spi_r_rx_payload ; break ;
+    case W_TX_PAYLOAD: type = spi_w_tx_payload ; break ;
+    case FLUSH_TX: type = spi_flush_tx ; break ;
+    case FLUSH_RX: type = spi_flush_rx ; break ;
+    case R_RX_PL_WID: type = spi_r_rx_pl_wid ; break ;
+    }
+  }
+  m_stats.spi_cmd[type]++ ;
+  m_stats.spi_bytes += len ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::add_histogram(uint32_t *hist, uint32_t value)
+{
+  uint8_t bucket = 0 ;
+  while (bucket < RF24_HIST_BUCKETS-1 && value >= (1UL << bucket)) bucket++ ;
+  hist[bucket]++ ;
+}
+#endif
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::get_stats(RF24Stats &stats)
+{
+#ifndef RF24_NO_STATS
+  memcpy(&stats, &m_stats, sizeof(RF24Stats)) ;
+#else
+  memset(&stats, 0, sizeof(RF24Stats)) ;
+#endif
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::reset_stats()
+{
+#ifndef RF24_NO_STATS
+  memset(&m_stats, 0, sizeof(RF24Stats)) ;
+  m_tx_start = 0 ;
+  m_lock_start = 0 ;
+#endif
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::max_retry_interrupt()
+{
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::data_sent_interrupt()
+{
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::data_received_interrupt()
+{
+  /* EXAMPLE CODE. COMMENT OUT AS WASTE OF MEMORY
+  uint8_t buffer[MAX_RXTXBUF+1] ;
+
+  uint8_t size = get_rx_data_size(get_pipe_available()) ;
+  read_payload(buffer, size) ;
+  buffer[size+1] = '\0' ;
+  DPRINT("Pipe %d: %s hex{", get_pipe_available(), buffer) ;
+  for (uint8_t i=0; i<size;i++){
+    DPRINT(" %X ", buffer[i]) ;
+  }
+  DPRINT("}\n") ;
+*/
+  return true;
+}
+
+NORDIC_TEMPLATE
+NORDIC_CLASS::NordicRF24T()
+{
+#ifndef ARDUINO
+  pthread_mutexattr_t attr ;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK) ;
+  if (pthread_mutex_init(&m_rwlock, &attr) != 0){
+    // Should just terminate here as it's a major resource problem
+    EPRINT("Cannot initialise mutex");
+    //exit(0);
+  }
+#endif
+  m_irq = 0;
+#ifndef ARDUINO
+  m_pBatch = NULL ;
+  // Measure the sleep overshoot now rather than on the first delay, which
+  // is taken under the lock while sending
+  rf24_sleep_overshoot() ;
+#endif
+  batch_begin() ;
+  m_auto_update = true ;
+  m_known_valid = 0 ;
+  m_state = rf24_power_down ;
+  m_settle_deadline = 0 ;
+  memset(&m_known, 0, sizeof(RF24Registers)) ;
+  reset_stats() ;
+  
+  radio_singleton = this ; // Driver needs to be just one instance for interrupt handling
+  
+  reset_class() ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::reset_rf24()
+{
+  if (!m_pGPIO) return false ;
+  if (!m_pGPIO->output(m_ce, GPIO::low)) return false ;
+  
+  if (!m_pSPI) return false ;
+  // Write every register regardless of the known state
+  if (!write_registers(rf24_reset_registers, true)) return false ;
+  set_state(rf24_power_down, 0) ;
+
+  reset_class() ;
+  
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::reset_class()
+{
+  const RF24Registers &regs = rf24_reset_registers ;
+  m_transmit_width = MAX_RXTXBUF ;
+  
+  m_is_plus = true ;
+
+  // Register defaults are decoded from the reset image
+  m_reg_status = 0 ;
+  m_reg_fifo = 0 ;
+  convert_config(regs.reg[REG_CONFIG]) ;
+  convert_enaa(regs.reg[REG_EN_AA]) ;
+  convert_enrxaddr(regs.reg[REG_EN_RXADDR]) ;
+  convert_setup(regs.reg[REG_RF_SETUP]) ;
+  convert_status(regs.reg[REG_STATUS]) ;
+  convert_fifo_status(regs.reg[REG_FIFO_STATUS]) ;
+  convert_dynamic_payload(regs.reg[REG_DYNPD]) ;
+  convert_feature(regs.reg[REG_FEATURE]) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_state(RF24State state, uint32_t settle_us)
+{
+  m_settle_deadline = rf24_micros() + settle_us ;
+  m_state = state ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::extend_settle(uint32_t settle_us)
+{
+  uint32_t deadline = rf24_micros() + settle_us ;
+  if ((int32_t)(deadline - m_settle_deadline) > 0) m_settle_deadline = deadline ;
+}
+
+NORDIC_TEMPLATE
+uint32_t NORDIC_CLASS::settle_remaining()
+{
+  // Signed difference copes with the micro second counter wrapping
+  int32_t remaining = (int32_t)(m_settle_deadline - rf24_micros()) ;
+  return remaining > 0?remaining:0 ;
+}
+
+NORDIC_TEMPLATE
+RF24State NORDIC_CLASS::get_state()
+{
+  RF24State state = (RF24State)m_state.load() ;
+  if (settle_remaining() > 0) return state ;
+  if (state == rf24_rx_settling) return rf24_rx ;
+  if (state == rf24_tx_settling) return rf24_tx ;
+  return state ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::wait_settled()
+{
+  uint32_t remaining = settle_remaining() ;
+  if (remaining > 0) delay_us(remaining) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::delay_us(uint32_t us)
+{
+#ifdef ARDUINO
+  if (m_pTimer) m_pTimer->microSleep(us) ;
+#else
+  uint64_t waited = rf24_delay_us(us) ;
+ #ifndef RF24_NO_STATS
+  uint64_t error = waited - (uint64_t)us * 1000 ;
+  m_stats.delay_count++ ;
+  m_stats.delay_error_ns += error ;
+  if (error > m_stats.delay_error_max_ns) m_stats.delay_error_max_ns = (uint32_t)error ;
+ #else
+  (void)waited ;
+ #endif
+#endif
+}
+
+NORDIC_TEMPLATE
+NORDIC_CLASS::~NordicRF24T()
+{
+#ifndef ARDUINO
+  pthread_mutex_destroy(&m_rwlock) ;  
+#endif
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_gpio(GPIO *pGPIO, uint8_t ce, uint8_t irq)
+{
+  if (!pGPIO) return false ;
+  m_pGPIO = pGPIO ;
+  m_irq = irq;
+  m_ce = ce ;
+
+  if (!pGPIO->setup(m_ce, GPIO::gpio_output)){
+    EPRINT("Cannot set GPIO output pin for CE\n") ;
+    return false ;
+  }
+  pGPIO->output(m_ce, GPIO::low) ;
+
+  if (m_irq > 0){
+    if (!pGPIO->setup(m_irq, GPIO::gpio_input)){
+      EPRINT("Cannot set GPIO input pin for IRQ\n") ;
+      return false ;
+    }
+    
+    if (!pGPIO->register_interrupt(m_irq, GPIO::falling, interrupt)){
+      EPRINT("Cannot set GPIO interrupt pin for IRQ\n") ;
+      return false ;
+    }
+  }
+  
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_spi(SPI *pSPI)
+{
+  m_pSPI = pSPI ;
+  return m_pSPI != NULL ;
+}
+
+#ifndef ARDUINO
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_spi_batch(IRF24SpiBatch *pBatch)
+{
+  m_pBatch = pBatch ;
+  return true ;
+}
+#endif
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_timer(Timer *pTimer)
+{
+  m_pTimer = pTimer ;
+  return m_pTimer != NULL ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::write_packet(uint8_t *packet)
+{
+  uint8_t packet_size = get_transmit_width() ;
+  if (!packet) return packet_size ;
+  if (!write_payload(packet, packet_size)){
+    EPRINT("write_payload failed\n");
+    return 0 ;
+  }
+  if (!ce_output(true)){
+    EPRINT("ce failed to be set high\n") ;
+    return 0 ;
+  }
+#ifndef RF24_NO_STATS
+  m_tx_start = rf24_micros() ;
+#endif
+  delay_us(11) ; // more than 10 micro seconds
+  if (!ce_output(false)){
+    EPRINT("ce failed to be set low\n") ;
+    return 0 ;
+  }
+  return packet_size ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_rx_data_size(uint8_t pipe)
+{
+  uint8_t width = 0, dynamic_width = 0, dynpd = 0 ;
+  bool both = false ;
+  if (pipe >= RF24_PIPES) return 0 ;
+#ifndef ARDUINO
+  // With a batch backend DYNPD, the static width and the dynamic width
+  // (R_RX_PL_WID) are read in one submission. Only the width which
+  // applies to the pipe is used
+  both = m_auto_update && m_pBatch ;
+#endif
+  // Frames are sent one at a time otherwise, so check DYNPD first and
+  // only read the width which applies
+  if (m_auto_update && !both && !read_dynamic_payload()) return 0 ;
+  batch_begin() ;
+  if (both) batch_add(REG_DYNPD, NULL, &dynpd, 1) ;
+  if (both || !reg_bit(m_reg_dynpd, pipe))
+    batch_add(REG_RX_PW_BASE+pipe, NULL, &width, 1) ;
+  if (both || reg_bit(m_reg_dynpd, pipe))
+    batch_add(R_RX_PL_WID, NULL, &dynamic_width, 1) ;
+  if (!batch_submit()) return 0 ;
+  if (both) convert_dynamic_payload(dynpd) ;
+  if (reg_bit(m_reg_dynpd, pipe)){
+    // Payload is dynamic for this pipe. Assume features
+    // are enabled because we have a dynamic payload
+    width = dynamic_width ;
+    if (width > MAX_RXTXBUF){
+      flushrx() ;
+      return 0 ; // Corrupt value
+    }
+  }
+  return width ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_payload(uint8_t *buffer, uint8_t len)
+{
+  if (!m_pSPI){
+    EPRINT("read_payload - no spi set\n") ;
+    return false ; // No SPI interface
+  }
+  // Check if receiving or transmitting.
+  // TO DO - ACKs with payloads will need reading in TX mode
+  //if (!is_receiver()){
+  //  EPRINT("read_payload - radio is not a receiver\n") ;
+  //  return false ;
+  //}
+
+  if (buffer == NULL || len > MAX_RXTXBUF){
+    EPRINT("read_payload - len too long %u\n", len) ;
+    return false ;
+  }
+  
+  // FIFO_STATUS is read in the same batch so callers can check for more
+  // payloads without another transfer
+  uint8_t fifo = 0 ;
+  batch_begin() ;
+  batch_add(R_RX_PAYLOAD, NULL, buffer, len) ;
+  batch_add(REG_FIFO_STATUS, NULL, &fifo, 1) ;
+  if (!batch_submit()){
+    EPRINT("read_payload - spi transfer failed\n") ;
+    return false ;
+  }
+  convert_fifo_status(fifo) ;
+  STAT_INC(rx_payloads) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_payload(uint8_t *buffer, uint8_t len)
+{
+  if (!m_pSPI){
+    EPRINT("write_payload - no spi set\n") ;
+    return false ; // No SPI interface
+  }
+  // Check if receiving or transmitting.
+  if (reg_bit(m_reg_config, 0)){
+    EPRINT("write_payload failed - set as receiver\n") ;
+    return false ;
+  }
+
+  if (buffer == NULL || len > MAX_RXTXBUF){
+    EPRINT("write_payload - no buffer or len out of bounds\n") ;
+    return false ;
+  }
+
+  uint8_t status = 0 ;
+  count_spi(W_TX_PAYLOAD, len+1) ;
+  if (!spi_transfer(W_TX_PAYLOAD, buffer, NULL, len, status)){
+    EPRINT("write_payload - spi transfer failed\n") ;
+    return false ;
+  }
+  convert_status(status) ;
+  return true ;  
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_register(uint8_t addr, uint8_t *val, uint8_t len)
+{
+  const uint16_t addmask = 0x01FF;
+  if (!m_pSPI){return false ;}
+
+  uint8_t status = 0 ;
+  addr &= addmask ;
+  count_spi(addr, len+1) ;
+  if (!spi_transfer(addr, NULL, val, len, status)) {
+    EPRINT("read_register - spi transfer failed\n") ;
+    return false ;
+  }
+  convert_status(status) ;
+  track_register(addr, val, len) ;
+
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_register(uint8_t addr, const uint8_t *val, uint8_t len)
+{
+  const uint16_t addmask = 0x01FF;
+  if (!m_pSPI) return false ;
+
+  uint8_t status = 0 ;
+  addr &= addmask ;
+  if (len > MAX_RXTXBUF){
+    EPRINT("write_register - len too large at %u\n", len);
+    return false ; // too much data
+  }
+  
+  count_spi(addr | RF24_WRITE_REG, len+1) ;
+  if (!spi_transfer(addr | RF24_WRITE_REG, val, NULL, len, status)){
+    EPRINT("write_register - spi transfer failed\n") ;
+    m_known_valid &= ~(1UL << addr) ;
+    return false ;
+  }
+  convert_status(status) ;
+  track_register(addr, val, len) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::track_register(uint8_t addr, const uint8_t *val, uint8_t len)
+{
+  if (addr >= RF24_REGISTERS || len == 0) return ;
+  if (RF24Registers::is_reserved(addr) || RF24Registers::is_volatile(addr)) return ;
+  uint8_t *full = m_known.address(addr) ;
+  if (full) memcpy(full, val, len > MAX_RF24_ADDRESS_LEN?MAX_RF24_ADDRESS_LEN:len) ;
+  m_known.reg[addr] = val[0] ;
+  m_known_valid |= (1UL << addr) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::batch_begin()
+{
+#ifndef ARDUINO
+  m_batch_frames = 0 ;
+  m_batch_bytes = 0 ;
+#endif
+  m_batch_ok = true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::batch_add(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len)
+{
+  if (len > MAX_RXTXBUF) return m_batch_ok = false ;
+  count_spi(cmd, len+1) ;
+#ifdef ARDUINO
+  // No system calls to save so transfer straight away
+  uint8_t status = 0 ;
+  if (!spi_transfer(cmd, tx, rx, len, status)){
+    if ((cmd & 0xE0) == RF24_WRITE_REG) m_known_valid &= ~(1UL << (cmd & 0x1F)) ;
+    return m_batch_ok = false ;
+  }
+  convert_status(status) ;
+  if ((cmd & 0xE0) == RF24_WRITE_REG && tx) track_register(cmd & 0x1F, tx, len) ;
+  else if ((cmd & 0xE0) == RF24_READ_REG && rx) track_register(cmd, rx, len) ;
+  return m_batch_ok ;
+#else
+  if (m_batch_frames >= RF24_BATCH_FRAMES || m_batch_bytes + len + 1 > RF24_BATCH_BYTES){
+    if (!batch_submit()) return false ;
+  }
+  uint8_t *frame = m_batch_buf + m_batch_bytes ;
+  frame[0] = cmd ;
+  if (tx) memcpy(frame+1, tx, len) ;
+  else memset(frame+1, 0, len) ;
+  // Writes are tracked now while the data is at hand and forgotten on failure
+  if ((cmd & 0xE0) == RF24_WRITE_REG && tx) track_register(cmd & 0x1F, tx, len) ;
+  m_batch_cmd[m_batch_frames] = cmd ;
+  m_batch_len[m_batch_frames] = len + 1 ;
+  m_batch_rx[m_batch_frames] = rx ;
+  m_batch_frames++ ;
+  m_batch_bytes += len + 1 ;
+  return m_batch_ok ;
+#endif
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::batch_submit()
+{
+#ifndef ARDUINO
+  if (m_batch_frames > 0){
+    bool ret = m_batch_ok ;
+    uint8_t *frame = m_batch_buf ;
+    if (ret && m_pBatch) ret = m_pBatch->transfer(m_batch_buf, m_batch_len, m_batch_frames) ;
+    else if (ret){
+      // Sequential fallback, one transfer per frame
+      for (uint8_t i=0; ret && i < m_batch_frames; frame += m_batch_len[i++])
+	ret = m_pSPI && m_pSPI->write(frame, m_batch_len[i]) && m_pSPI->read(frame, m_batch_len[i]) ;
+    }
+    frame = m_batch_buf ;
+    for (uint8_t i=0; i < m_batch_frames; frame += m_batch_len[i++]){
+      uint8_t cmd = m_batch_cmd[i] ;
+      if (!ret){
+	if ((cmd & 0xE0) == RF24_WRITE_REG) m_known_valid &= ~(1UL << (cmd & 0x1F)) ;
+	continue ;
+      }
+      convert_status(frame[0]) ;
+      if (m_batch_rx[i]){
+	memcpy(m_batch_rx[i], frame+1, m_batch_len[i]-1) ;
+	if ((cmd & 0xE0) == RF24_READ_REG) track_register(cmd, frame+1, m_batch_len[i]-1) ;
+      }
+    }
+    if (!ret){
+      EPRINT("batch_submit - spi transfer failed\n") ;
+      m_batch_ok = false ;
+    }
+  }
+  m_batch_frames = 0 ;
+  m_batch_bytes = 0 ;
+#endif
+  return m_batch_ok ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::end_interrupt()
+{
+  uint8_t clear = 0xF0 ;
+  STAT_INC(flush_rx) ;
+  batch_begin() ;
+  batch_add(FLUSH_RX, NULL, NULL, 0) ;
+  batch_add(REG_STATUS | RF24_WRITE_REG, &clear, NULL, 1) ;
+  return batch_submit() ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::enable_features(bool enable)
+{
+  if (!m_pSPI) return false ;
+  if (!m_is_plus){
+    m_spibuf[0] = ACTIVATE ;
+    m_spibuf[1] = enable?ACTIVATE_FEATURES:0;
+    count_spi(*m_spibuf, 2) ;
+    return m_pSPI->write(m_spibuf, 2) ;
+  }
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::flushtx()
+{
+  uint8_t status = 0 ;
+  count_spi(FLUSH_TX, 1) ;
+  STAT_INC(flush_tx) ;
+  bool ret = spi_command(FLUSH_TX, status) ;
+  if (ret) convert_status(status) ;
+  return ret ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::flushrx()
+{
+  uint8_t status = 0 ;
+  count_spi(FLUSH_RX, 1) ;
+  STAT_INC(flush_rx) ;
+  bool ret = spi_command(FLUSH_RX, status) ;
+  if (ret) convert_status(status) ;
+  return ret ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_dynamic_payload()
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_DYNPD, &reg, 1)) return false ;
+  convert_dynamic_payload(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_dynamic_payload(uint8_t reg)
+{
+  m_reg_dynpd = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_dynamic_payload()
+{
+  uint8_t reg = m_reg_dynpd & 0x3F ;
+  return write_register(REG_DYNPD, &reg, 1) ;  
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_dynamic_payload(uint8_t pipe)
+{
+  if (pipe >= RF24_PIPES) return false ; // out of range
+  if (m_auto_update) read_dynamic_payload() ;
+  return reg_bit(m_reg_dynpd, pipe) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_dynamic_payload(uint8_t pipe, bool set)
+{
+  if (pipe >= RF24_PIPES) return ; // out of range
+  set_reg_bit(m_reg_dynpd, pipe, set) ;
+  if(m_auto_update) write_dynamic_payload() ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_fifo_status()
+{
+  uint8_t reg = 0;
+  if (!read_register(REG_FIFO_STATUS, &reg, 1)) return false ;
+  convert_fifo_status(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_fifo_status(uint8_t reg)
+{
+  if (!reg_bit(m_reg_fifo, 1) && reg_bit(reg, 1)) STAT_INC(rx_fifo_full) ;
+  m_reg_fifo = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_feature()
+{
+  uint8_t reg = 0;
+  if (!read_register(REG_FEATURE, &reg, 1)) return false ;
+  convert_feature(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_feature(uint8_t reg)
+{
+  m_reg_feature = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_feature()
+{
+  uint8_t reg = m_reg_feature & 0x07 ;
+  return write_register(REG_FEATURE, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_setup()
+{
+  uint8_t reg = 0;
+  if (!read_register(REG_RF_SETUP, &reg, 1)) return false ;
+  convert_setup(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_setup(uint8_t reg)
+{
+  m_reg_setup = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_setup()
+{
+  // Obsolete LNA and reserved bits are written as 0
+  uint8_t reg = m_reg_setup & 0xBE ;
+  return write_register(REG_RF_SETUP, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_power_level(uint8_t level)
+{
+  if (level > RF24_0DBM) level = RF24_0DBM ;
+  m_reg_setup = (m_reg_setup & ~0x06) | (level << 1) ;
+  if (m_auto_update) write_setup() ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_data_rate(uint8_t datarate)
+{
+  if (datarate < RF24_250KBPS || datarate > RF24_2MBPS) datarate = RF24_1MBPS;
+  m_reg_setup = (m_reg_setup & ~0x28) |
+    (datarate == RF24_250KBPS?_BV(5):0) | (datarate == RF24_2MBPS?_BV(3):0) ;
+  if (m_auto_update) write_setup() ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_continuous_carrier_transmit(bool set)
+{
+  set_reg_bit(m_reg_setup, 7, set) ;
+  set_reg_bit(m_reg_setup, 4, set) ;
+  if (m_auto_update) write_setup() ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_power_level()
+{
+  if (m_auto_update) read_setup() ;
+  return (m_reg_setup & 0x06) >> 1 ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_data_rate()
+{
+  if (m_auto_update) read_setup() ;
+  if (reg_bit(m_reg_setup, 5)) return RF24_250KBPS ;
+  return reg_bit(m_reg_setup, 3)?RF24_2MBPS:RF24_1MBPS ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_continuous_carrier_transmit()
+{
+  if (m_auto_update) read_setup() ;
+  return reg_bit(m_reg_setup, 7) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_status(uint8_t status)
+{
+  if (!reg_bit(m_reg_status, 0) && reg_bit(status, 0)) STAT_INC(tx_fifo_full) ;
+  m_reg_status = status ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_pipe_available()
+{
+  return 0x07 & (m_reg_status >> 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::has_data_sent()
+{
+  return reg_bit(m_reg_status, 5) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_at_max_retry_limit()
+{
+  return reg_bit(m_reg_status, 4) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::has_received_data()
+{
+  return reg_bit(m_reg_status, 6) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_transmit_full()
+{
+  return reg_bit(m_reg_status, 0) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_status()
+{
+  uint8_t reg = 0 ;
+
+  if (!read_register(REG_STATUS, &reg, 1)) return false ;
+  convert_status(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::clear_interrupts()
+{
+  uint8_t reg = 0xF0 ;
+  return write_register(REG_STATUS, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_observe(uint8_t &packets_lost, uint8_t &retransmitted)
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_OBSERVE_TX, &reg, 1)) return false ;
+  packets_lost = 0x0F & (reg >> 4) ;
+  retransmitted = 0x0F & reg ;
+  return true;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_registers(RF24Registers &regs)
+{
+  uint8_t width = MAX_RF24_ADDRESS_LEN ;
+  memset(&regs, 0, sizeof(RF24Registers)) ;
+
+  // Single byte registers in one batch, then the addresses at the
+  // active width read from SETUP_AW
+  batch_begin() ;
+  for (uint8_t addr=0; addr < RF24_REGISTERS; addr++){
+    if (RF24Registers::is_reserved(addr) || regs.address(addr)) continue ;
+    batch_add(addr, NULL, &regs.reg[addr], 1) ;
+  }
+  if (!batch_submit()) return false ;
+  width = regs.get_address_width() ;
+  for (uint8_t addr=0; addr < RF24_REGISTERS; addr++){
+    uint8_t *full = regs.address(addr) ;
+    if (full) batch_add(addr, NULL, full, width) ;
+  }
+  if (!batch_submit()) return false ;
+  for (uint8_t addr=0; addr < RF24_REGISTERS; addr++){
+    const uint8_t *full = regs.address(addr) ;
+    if (full) regs.reg[addr] = full[0] ;
+  }
+
+  // Bring the class cache in line with the hardware
+  convert_config(regs.reg[REG_CONFIG]) ;
+  convert_enaa(regs.reg[REG_EN_AA]) ;
+  convert_enrxaddr(regs.reg[REG_EN_RXADDR]) ;
+  convert_setup(regs.reg[REG_RF_SETUP]) ;
+  convert_status(regs.reg[REG_STATUS]) ;
+  convert_fifo_status(regs.reg[REG_FIFO_STATUS]) ;
+  convert_dynamic_payload(regs.reg[REG_DYNPD]) ;
+  convert_feature(regs.reg[REG_FEATURE]) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::apply(const RadioConfig &config)
+{
+  RF24Registers target = m_known ;
+
+  if (!config.is_valid()){
+    EPRINT("apply - invalid configuration\n") ;
+    return false ;
+  }
+  // Keep the power and mode bits from the class if CONFIG is unknown
+  if (!is_known(REG_CONFIG))
+    target.reg[REG_CONFIG] = m_reg_config & (_BV(1) | _BV(0)) ;
+  config.encode(target) ;
+
+  if (!write_registers(target, false)) return false ;
+  m_transmit_width = config.transmit_width ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_registers(const RF24Registers &regs, bool force)
+{
+  // FEATURE is written before DYNPD as dynamic payloads depend on it.
+  // SETUP_AW is written before the addresses
+  static const uint8_t order[] = {
+    REG_CONFIG, REG_EN_AA, REG_EN_RXADDR, REG_SETUP_AW, REG_SETUP_RETR,
+    REG_RF_CH, REG_RF_SETUP, REG_RX_ADDR_BASE, REG_RX_ADDR_BASE+1,
+    REG_RX_ADDR_BASE+2, REG_RX_ADDR_BASE+3, REG_RX_ADDR_BASE+4,
+    REG_RX_ADDR_BASE+5, REG_TX_ADDR, REG_RX_PW_BASE, REG_RX_PW_BASE+1,
+    REG_RX_PW_BASE+2, REG_RX_PW_BASE+3, REG_RX_PW_BASE+4, REG_RX_PW_BASE+5,
+    REG_FEATURE, REG_DYNPD} ;
+  uint8_t width = regs.get_address_width() ;
+
+  // Addresses are rewritten at the new width if the width changes
+  bool width_changed = force || !is_known(REG_SETUP_AW) ||
+    regs.reg[REG_SETUP_AW] != m_known.reg[REG_SETUP_AW] ;
+  // All writes go in one batch
+  batch_begin() ;
+  for (uint8_t i=0; i < sizeof(order); i++){
+    uint8_t addr = order[i] ;
+    const uint8_t *full = regs.address(addr) ;
+    if (full){
+      if (!width_changed && is_known(addr) &&
+	  memcmp(full, m_known.address(addr), width) == 0) continue ;
+      batch_add(addr | RF24_WRITE_REG, full, NULL, width) ;
+    }else{
+      if (!force && is_known(addr) && regs.reg[addr] == m_known.reg[addr]) continue ;
+      if (addr == REG_FEATURE && regs.reg[addr]){
+	// ACTIVATE is sent outside the batch
+	if (!batch_submit() || !enable_features(true)) return false ;
+      }
+      batch_add(addr | RF24_WRITE_REG, &regs.reg[addr], NULL, 1) ;
+    }
+  }
+  if (!batch_submit()) return false ;
+
+  convert_config(regs.reg[REG_CONFIG]) ;
+  convert_enaa(regs.reg[REG_EN_AA]) ;
+  convert_enrxaddr(regs.reg[REG_EN_RXADDR]) ;
+  convert_setup(regs.reg[REG_RF_SETUP]) ;
+  convert_dynamic_payload(regs.reg[REG_DYNPD]) ;
+  convert_feature(regs.reg[REG_FEATURE]) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::carrier_detect(bool &cd)
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_CD, &reg, 1)) return false ;
+  cd = ((_BV(0) & reg) > 0);
+  return true ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_rx_address(uint8_t pipe, const uint8_t *address, uint8_t len)
+{
+  if (pipe >= RF24_PIPES) return false ; // out of range
+
+  if (pipe <= 1){
+    uint8_t address_width = get_address_width() ;
+    if (len != address_width){
+      EPRINT("set_rx_address width invalid: %u\n", len) ;
+      return false ;
+    }
+    return write_register(REG_RX_ADDR_BASE+pipe, address, address_width) ;
+  }
+  if (len < 1){
+    EPRINT("set_rx_address pipe %u invalid len %u", pipe, len) ;
+    return false ;
+  }
+
+  return write_register(REG_RX_ADDR_BASE+pipe, address, 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::get_rx_address(uint8_t pipe, uint8_t *address, uint8_t *len)
+{
+  uint8_t full_address[5], address_width = 0, low_byte = 0;
+  if (pipe >= RF24_PIPES) return false ; // out of range
+
+  address_width = get_address_width() ;
+  if (address_width == 0) return false ;
+  
+  if (address == NULL){
+    *len = address_width ;
+    return true ;
+  }
+
+  if (address_width > *len) return false;
+  
+  if (pipe > 1){
+    if (!read_register(REG_RX_ADDR_BASE+1, full_address, address_width))
+      return false;
+    if (!read_register(REG_RX_ADDR_BASE+pipe, &low_byte, 1)) return false ;
+    full_address[0] = low_byte ;
+    memcpy(address, full_address, *len);
+    return true ;  
+  } 
+
+  return read_register(REG_RX_ADDR_BASE+pipe, address, address_width);
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_tx_address(const uint8_t *address, uint8_t len)
+{
+  uint8_t address_width = get_address_width();
+  if (address_width != len){
+    EPRINT("set_tx_address invalid len %u - address_width %u\n", len, address_width) ;
+    return false ;
+  }
+
+  return write_register(REG_TX_ADDR, address, address_width) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::get_tx_address(uint8_t *address, uint8_t *len)
+{
+  uint8_t address_width = get_address_width();
+  if (address_width == 0) return false ;
+
+  if (address == NULL){
+    *len = address_width ;
+    return true ;
+  }
+  if (address_width > *len) return false ;
+  *len = address_width ;
+  return read_register(REG_TX_ADDR, address, address_width) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::get_payload_width(uint8_t pipe, uint8_t *width)
+{
+  if (width == NULL) return false ;
+  if (pipe >= RF24_PIPES) return false ; 
+  return read_register(REG_RX_PW_BASE+pipe, width,1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_payload_width(uint8_t pipe, uint8_t width)
+{
+  if (pipe >= RF24_PIPES) return false ;
+  if (width > MAX_RXTXBUF) return false ;  
+  return write_register(REG_RX_PW_BASE+pipe, &width, 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_config()
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_CONFIG, &reg, 1)) return false ;
+  convert_config(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_config(uint8_t reg)
+{
+  m_reg_config = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_config()
+{
+  uint8_t reg = m_reg_config & 0x7F ;
+  return write_register(REG_CONFIG, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_enaa()
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_EN_AA, &reg, 1)) return false ;
+  convert_enaa(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_enaa(uint8_t reg)
+{
+  m_reg_en_aa = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_enaa()
+{
+  uint8_t reg = m_reg_en_aa & 0x3F ;
+  return write_register(REG_EN_AA, &reg, 1) ;  
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_pipe_ack(uint8_t pipe)
+{
+  if (pipe >= RF24_PIPES) return false ; // out of range
+  if (m_auto_update) read_enaa() ;
+  return reg_bit(m_reg_en_aa, pipe) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::set_pipe_ack(uint8_t pipe, bool val)
+{
+  if (pipe >= RF24_PIPES) return;
+  set_reg_bit(m_reg_en_aa, pipe, val) ;
+  if (m_auto_update) write_enaa() ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::read_enrxaddr()
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_EN_RXADDR, &reg, 1)) return false ;
+  convert_enrxaddr(reg) ;
+  return true ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::convert_enrxaddr(uint8_t reg)
+{
+  m_reg_en_rxaddr = reg ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::write_enrxaddr()
+{
+  uint8_t reg = m_reg_en_rxaddr & 0x3F ;
+  return write_register(REG_EN_RXADDR, &reg, 1) ;  
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::is_pipe_enabled(uint8_t pipe)
+{
+  if (pipe >= RF24_PIPES) return false ; // out of range                                                             
+  if (m_auto_update) read_enrxaddr() ;
+  return reg_bit(m_reg_en_rxaddr, pipe) ;
+}
+
+NORDIC_TEMPLATE
+void NORDIC_CLASS::enable_pipe(uint8_t pipe, bool enabled)
+{
+  if (pipe >= RF24_PIPES) return;
+  set_reg_bit(m_reg_en_rxaddr, pipe, enabled) ;
+  if (m_auto_update) write_enrxaddr() ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_address_width(uint8_t width)
+{
+  // Check for valid byte address length (3, 4 or 5 bytes)
+  if (width > MAX_RF24_ADDRESS_LEN || width < MIN_RF24_ADDRESS_LEN) return false ;
+
+  uint8_t reg = width - 2 ;
+  
+  return write_register(REG_SETUP_AW, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_address_width()
+{
+  uint8_t reg = 0 ;
+  if (!read_register(REG_SETUP_AW, &reg, 1)) return 0 ;
+
+  return reg + 2 ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_retry(uint8_t delay_multiplier, uint8_t retry_count)
+{
+  // Check value limits. Only 4 bit values accepted
+  if (delay_multiplier >= 0xF0 || retry_count >= 0xF0) return false ;
+  uint8_t reg = retry_count + (delay_multiplier << 4);
+  return write_register(REG_SETUP_RETR, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+int8_t NORDIC_CLASS::get_retry_delay()
+{
+  uint8_t reg = 0;
+  if (!read_register(REG_SETUP_RETR, &reg, 1)) return -1 ;
+  return (int8_t)(reg >> 4) ;
+}
+
+NORDIC_TEMPLATE
+int8_t NORDIC_CLASS::get_retry_count()
+{
+  uint8_t reg = 0;
+  if (!read_register(REG_SETUP_RETR, &reg, 1)) return -1 ;
+  return (int8_t)(reg & 0x0F) ;
+}
+
+NORDIC_TEMPLATE
+bool NORDIC_CLASS::set_channel(uint8_t channel)
+{
+  if (channel > 125) return false ;
+  uint8_t reg = channel & ~0x80 ; // Clear top bit if set
+  return write_register(REG_RF_CH, &reg, 1) ;
+}
+
+NORDIC_TEMPLATE
+uint8_t NORDIC_CLASS::get_channel()
+{
+  uint8_t reg ;
+  if (!read_register(REG_RF_CH, &reg, 1)) return 0x80 ; // return invalid channel on error
+  return reg ;
+}
+
+#undef RF24_NOP
+#undef RF24_READ_REG
+#undef RF24_WRITE_REG
+#undef R_RX_PAYLOAD
+#undef W_TX_PAYLOAD
+#undef FLUSH_TX
+#undef FLUSH_RX
+#undef REUSE_TX_PL
+#undef R_RX_PL_WID
+#undef W_ACK_PAYLOAD
+#undef W_TX_PAYLOAD_NO_ACK
+#undef ACTIVATE
+#undef ACTIVATE_FEATURES
+#undef NORDIC_TEMPLATE
+#undef NORDIC_CLASS
+#ifdef RF24_LOCAL_BV
+ #undef _BV
+ #undef RF24_LOCAL_BV
+#endif
+
+#endif
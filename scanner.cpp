@@ -0,0 +1,284 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "scanner.hpp"
+#include "rf24time.hpp"
+#include <string.h>
+#ifndef ARDUINO
+ #include <unistd.h>
+#endif
+
+// Stride through the band so neighbouring channels are sampled apart in time.
+// Must be coprime with RF24_SCAN_CHANNELS to visit every channel
+#define SCAN_STRIDE 5
+
+RF24Scanner::RF24Scanner(NordicRF24 *pRadio, IHardwareGPIO *pGPIO, IHardwareTimer *pTimer, uint8_t ce)
+{
+  m_pRadio = pRadio ;
+  m_pGPIO = pGPIO ;
+  m_pTimer = pTimer ;
+  m_ce = ce ;
+  m_min_samples = RF24_SCAN_MIN_SAMPLES ;
+  m_max_samples = RF24_SCAN_MAX_SAMPLES ;
+  m_alpha = RF24_SCAN_DECAY ;
+  m_original_channel = 0 ;
+  m_surveys = 0 ;
+  m_survey_us = 0 ;
+  memset(m_samples, 0, sizeof(m_samples)) ;
+  memset(m_hits, 0, sizeof(m_hits)) ;
+  for (int i=0; i < RF24_SCAN_CHANNELS; i++) m_occupancy[i] = 0.0f ;
+#ifndef ARDUINO
+  m_running = false ;
+  m_interval_ms = 0 ;
+  pthread_mutex_init(&m_datalock, NULL) ;
+#endif
+}
+
+RF24Scanner::~RF24Scanner()
+{
+#ifndef ARDUINO
+  stop() ;
+  pthread_mutex_destroy(&m_datalock) ;
+#endif
+}
+
+void RF24Scanner::lock_data()
+{
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_datalock) ;
+#endif
+}
+
+void RF24Scanner::unlock_data()
+{
+#ifndef ARDUINO
+  pthread_mutex_unlock(&m_datalock) ;
+#endif
+}
+
+bool RF24Scanner::set_dwell(uint8_t min_samples, uint8_t max_samples)
+{
+  if (min_samples == 0 || min_samples > max_samples) return false ;
+  m_min_samples = min_samples ;
+  m_max_samples = max_samples ;
+  return true ;
+}
+
+bool RF24Scanner::set_decay(float alpha)
+{
+  if (alpha <= 0.0f || alpha > 1.0f) return false ;
+  m_alpha = alpha ;
+  return true ;
+}
+
+bool RF24Scanner::begin()
+{
+  m_original_channel = m_pRadio->get_channel() ;
+  if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)) return false ;
+  m_pRadio->power_up(true) ;
+  m_pRadio->receiver(true) ;
+  m_pRadio->delay_us(RF24_SETTLE_US) ;
+  return true ;
+}
+
+void RF24Scanner::end()
+{
+  m_pRadio->set_channel(m_original_channel) ;
+  m_pGPIO->output(m_ce, IHardwareGPIO::low) ;
+  m_pRadio->power_up(false) ;
+}
+
+bool RF24Scanner::sample(uint8_t channel, bool &cd)
+{
+  if (!m_pRadio->set_channel(channel)) return false ;
+  if (!m_pGPIO->output(m_ce, IHardwareGPIO::high)) return false ;
+  m_pRadio->delay_us(174) ; // Tstby2a +Tdelay_AGC
+  if (!m_pGPIO->output(m_ce, IHardwareGPIO::low)) return false ;
+  m_pRadio->delay_us(4);
+  return m_pRadio->carrier_detect(cd) ;
+}
+
+bool RF24Scanner::survey()
+{
+  uint8_t samples[RF24_SCAN_CHANNELS], hits[RF24_SCAN_CHANNELS] ;
+  bool decided[RF24_SCAN_CHANNELS] ;
+  uint8_t remaining = RF24_SCAN_CHANNELS ;
+  uint32_t start = rf24_micros() ;
+  bool cd = false ;
+
+  memset(samples, 0, sizeof(samples)) ;
+  memset(hits, 0, sizeof(hits)) ;
+  memset(decided, 0, sizeof(decided)) ;
+
+  for (uint8_t pass=0; pass < m_max_samples && remaining > 0; pass++){
+    for (uint8_t i=0; i < RF24_SCAN_CHANNELS; i++){
+      uint8_t chan = (i * SCAN_STRIDE) % RF24_SCAN_CHANNELS ;
+      if (decided[chan]) continue ;
+      if (!sample(chan, cd)) return false ;
+      samples[chan]++ ;
+      if (cd) hits[chan]++ ;
+      // Stop early on channels which are clearly quiet or clearly busy
+      if (samples[chan] >= m_max_samples ||
+	  (samples[chan] >= m_min_samples &&
+	   (hits[chan] == 0 || hits[chan] == samples[chan]))){
+	decided[chan] = true ;
+	remaining-- ;
+      }
+    }
+  }
+
+  lock_data() ;
+  for (uint8_t chan=0; chan < RF24_SCAN_CHANNELS; chan++){
+    float occupancy = (float)hits[chan] / (float)samples[chan] ;
+    if (m_surveys == 0) m_occupancy[chan] = occupancy ;
+    else m_occupancy[chan] = m_alpha * occupancy + (1.0f - m_alpha) * m_occupancy[chan] ;
+  }
+  memcpy(m_samples, samples, sizeof(m_samples)) ;
+  memcpy(m_hits, hits, sizeof(m_hits)) ;
+  m_survey_us = rf24_micros() - start ;
+  m_surveys++ ;
+  unlock_data() ;
+
+  return true ;
+}
+
+#ifndef ARDUINO
+void *RF24Scanner::scan_thread(void *p)
+{
+  RF24Scanner *scanner = (RF24Scanner *)p ;
+  while (scanner->m_running){
+    if (!scanner->survey()) break ;
+    if (scanner->m_interval_ms) usleep(scanner->m_interval_ms * 1000) ;
+  }
+  scanner->end() ;
+  return NULL ;
+}
+
+bool RF24Scanner::start(uint32_t interval_ms)
+{
+  if (m_running) return false ;
+  if (!begin()) return false ;
+  m_interval_ms = interval_ms ;
+  m_running = true ;
+  if (pthread_create(&m_thread, NULL, scan_thread, this) != 0){
+    m_running = false ;
+    end() ;
+    return false ;
+  }
+  return true ;
+}
+
+void RF24Scanner::stop()
+{
+  if (!m_running) return ;
+  m_running = false ;
+  pthread_join(m_thread, NULL) ;
+}
+#endif
+
+uint32_t RF24Scanner::get_surveys()
+{
+  uint32_t ret = 0 ;
+  lock_data() ;
+  ret = m_surveys ;
+  unlock_data() ;
+  return ret ;
+}
+
+float RF24Scanner::get_occupancy(uint8_t channel)
+{
+  float ret = 0.0f ;
+  if (channel >= RF24_SCAN_CHANNELS) return ret ;
+  lock_data() ;
+  ret = m_occupancy[channel] ;
+  unlock_data() ;
+  return ret ;
+}
+
+uint8_t RF24Scanner::get_samples(uint8_t channel)
+{
+  uint8_t ret = 0 ;
+  if (channel >= RF24_SCAN_CHANNELS) return ret ;
+  lock_data() ;
+  ret = m_samples[channel] ;
+  unlock_data() ;
+  return ret ;
+}
+
+uint8_t RF24Scanner::best_channel(uint8_t first, uint8_t last)
+{
+  uint8_t best = first ;
+  if (last >= RF24_SCAN_CHANNELS) last = RF24_SCAN_CHANNELS-1 ;
+  lock_data() ;
+  for (uint8_t chan=first; chan <= last; chan++){
+    if (m_occupancy[chan] < m_occupancy[best]) best = chan ;
+  }
+  unlock_data() ;
+  return best ;
+}
+
+void RF24Scanner::write_table(FILE *f)
+{
+  const int columns = 10 ;
+  int col = 0 ;
+
+  fprintf(f, "CHAN\t") ;
+  for (col=0; col < columns; col++) fprintf(f, "%02X\t", col) ;
+  fprintf(f, "\n====\t") ;
+  for (col=0; col < columns; col++) fprintf(f, "==\t") ;
+  fprintf(f, "\n") ;
+  col = 0 ;
+  lock_data() ;
+  for (uint8_t chan=0; chan < RF24_SCAN_CHANNELS; chan++){
+    if (col == 0) fprintf(f, "%02X =\t", chan) ;
+    // Percentage of samples with a carrier, capped to 2 digits
+    int pct = (int)(m_occupancy[chan] * 100.0f + 0.5f) ;
+    if (pct > 99) pct = 99 ;
+    if (pct == 0 && m_hits[chan] == 0) fprintf(f, "--\t") ;
+    else fprintf(f, "%02d\t", pct) ;
+    if (++col >= columns){
+      col = 0 ;
+      fprintf(f, "\n") ;
+    }
+  }
+  unlock_data() ;
+  fprintf(f, "\n") ;
+  fflush(f) ;
+}
+
+void RF24Scanner::write_json(FILE *f)
+{
+  lock_data() ;
+  fprintf(f, "{\"surveys\":%u,\"survey_us\":%u,\"decay\":%.3f,\"channels\":[",
+	  m_surveys, m_survey_us, m_alpha) ;
+  for (uint8_t chan=0; chan < RF24_SCAN_CHANNELS; chan++){
+    fprintf(f, "%s{\"channel\":%u,\"mhz\":%u,\"occupancy\":%.4f,\"samples\":%u,\"hits\":%u}",
+	    chan?",":"", chan, 2400+chan, m_occupancy[chan], m_samples[chan], m_hits[chan]) ;
+  }
+  fprintf(f, "]}\n") ;
+  unlock_data() ;
+  fflush(f) ;
+}
+
+void RF24Scanner::write_csv(FILE *f)
+{
+  lock_data() ;
+  fprintf(f, "survey,channel,mhz,occupancy,samples,hits\n") ;
+  for (uint8_t chan=0; chan < RF24_SCAN_CHANNELS; chan++){
+    fprintf(f, "%u,%u,%u,%.4f,%u,%u\n", m_surveys, chan, 2400+chan,
+	    m_occupancy[chan], m_samples[chan], m_hits[chan]) ;
+  }
+  unlock_data() ;
+  fflush(f) ;
+}
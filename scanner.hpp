@@ -0,0 +1,98 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_SCANNER
+#define __RF24_SCANNER
+
+#include "rpinrf24.hpp"
+#include "rf24atomic.hpp"
+#include <stdio.h>
+
+#define RF24_SCAN_CHANNELS 126
+#define RF24_SCAN_MIN_SAMPLES 8
+#define RF24_SCAN_MAX_SAMPLES 99
+#define RF24_SCAN_DECAY 0.3f
+
+// Carrier detect channel survey.
+// Each survey makes repeated passes over the band, taking one sample per
+// channel per pass so bursty interference is spread over time. A channel
+// stops being sampled once min_samples agree it is clearly quiet (no carrier)
+// or clearly busy (carrier on every sample). Other channels are sampled up to
+// max_samples. Occupancy is smoothed across surveys with an exponential decay.
+class RF24Scanner{
+public:
+  RF24Scanner(NordicRF24 *pRadio, IHardwareGPIO *pGPIO, IHardwareTimer *pTimer, uint8_t ce) ;
+  ~RF24Scanner() ;
+
+  // Samples taken before a channel can be decided and the limit per survey
+  bool set_dwell(uint8_t min_samples, uint8_t max_samples) ;
+  // Weight of the latest survey in the smoothed occupancy, 0 to 1.
+  // 1 disables smoothing
+  bool set_decay(float alpha) ;
+
+  // Put the radio in receive mode and restore the channel and power afterwards
+  bool begin() ;
+  void end() ;
+  // Run a single survey. begin() must have been called
+  bool survey() ;
+
+#ifndef ARDUINO
+  // Run surveys continuously on a background thread. Calls begin and end.
+  // interval_ms is the pause between surveys
+  bool start(uint32_t interval_ms) ;
+  void stop() ;
+#endif
+
+  // Number of completed surveys
+  uint32_t get_surveys() ;
+  // Smoothed fraction of samples with a carrier, 0 to 1
+  float get_occupancy(uint8_t channel) ;
+  // Samples taken on a channel during the last survey
+  uint8_t get_samples(uint8_t channel) ;
+  // Least occupied channel from first to last inclusive
+  uint8_t best_channel(uint8_t first, uint8_t last) ;
+
+  // Output the occupancy map
+  void write_table(FILE *f) ;
+  void write_json(FILE *f) ;
+  void write_csv(FILE *f) ;
+
+protected:
+  bool sample(uint8_t channel, bool &cd) ;
+#ifndef ARDUINO
+  static void *scan_thread(void *p) ;
+  pthread_t m_thread ;
+  pthread_mutex_t m_datalock ;
+  RF24Atomic<bool> m_running ;
+  uint32_t m_interval_ms ;
+#endif
+  void lock_data() ;
+  void unlock_data() ;
+
+  NordicRF24 *m_pRadio ;
+  IHardwareGPIO *m_pGPIO ;
+  IHardwareTimer *m_pTimer ;
+  uint8_t m_ce ;
+  uint8_t m_min_samples ;
+  uint8_t m_max_samples ;
+  float m_alpha ;
+  uint8_t m_original_channel ;
+  uint32_t m_surveys ;
+  uint32_t m_survey_us ; // duration of last survey
+  uint8_t m_samples[RF24_SCAN_CHANNELS] ;
+  uint8_t m_hits[RF24_SCAN_CHANNELS] ;
+  float m_occupancy[RF24_SCAN_CHANNELS] ;
+};
+
+#endif
@@ -34,6 +34,7 @@ int opt_irq = 0,
   opt_listen = 0,
   opt_channel = 0,
   opt_message = 0,
+  opt_file = 0,
   opt_speed = 1;
 bool opt_block = false ;
 
@@ -48,12 +49,13 @@ void siginterrupt(int sig)
 
 int main(int argc, char **argv)
 {
-  const char usage[] = "Usage: %s -c ce -i irq [-o channel] [-a address] [-s 250|1|2] [-l] [-s message]\n" ;
+  const char usage[] = "Usage: %s -c ce -i irq [-o channel] [-a address] [-s 250|1|2] [-l] [-m message] [-f file|-] [-b]\n" ;
   int opt = 0 ;
   uint8_t rf24address[ADDR_WIDTH] ;
   bool opt_addr_set = false ;
   struct sigaction siginthandle ;
   char szMessage[RF24_BUFFER_WRITE+1] ;
+  const char *szFile = NULL ;
 
   BufferedRF24 radio ;
 
@@ -68,7 +70,7 @@ int main(int argc, char **argv)
     return EXIT_FAILURE ;
   }
   
-  while ((opt = getopt(argc, argv, "s:i:c:o:a:lm:b")) != -1) {
+  while ((opt = getopt(argc, argv, "s:i:c:o:a:lm:f:b")) != -1) {
     switch (opt) {
     case 'l': // listen
       opt_listen = 1;
@@ -77,6 +79,10 @@ int main(int argc, char **argv)
       opt_message = 1 ;
       strncpy(szMessage, optarg, RF24_BUFFER_WRITE) ;
       break;
+    case 'f': // file to stream, - for stdin
+      opt_file = 1 ;
+      szFile = optarg ;
+      break;
     case 'i': // IRQ pin
       opt_irq = atoi(optarg) ;
       break ;
@@ -144,6 +150,11 @@ int main(int argc, char **argv)
   spi.setSpeed(6000000) ;
   radio.set_spi(&spi) ;
 
+  // Submit multi-command sequences in one ioctl. Falls back to
+  // single transfers if the device cannot be opened again
+  RF24SpidevBatch batch ;
+  if (batch.open(0, 0, 6000000)) radio.set_spi_batch(&batch) ;
+
   if (!radio.set_gpio(&pi, opt_ce, opt_irq)){
     fprintf(stderr, "Failed to initialise GPIO\n") ;
     return 1 ;
@@ -169,7 +180,7 @@ int main(int argc, char **argv)
   radio.set_transmit_width(PAYLOAD_WIDTH);
 
   radio.receiver(true) ;
-  if (opt_message) radio.receiver(false) ;
+  if (opt_message || opt_file) radio.receiver(false) ;
   
   radio.power_up(true) ;
   pi.microSleep(130) ;// 130 micro seconds
@@ -201,15 +212,31 @@ int main(int argc, char **argv)
       }
       if(!opt_block) sleep(1); // put in a sleep to stop overloading the CPU
     }
-  }else if (opt_message){ // Send a message
+  }else if (opt_message || opt_file){ // Send a message or stream a file
     // Use the default address if one isn't specified on the command line
     if (!opt_addr_set) memcpy(rf24address, def_address, ADDR_WIDTH) ;
     // RX and TX addresses have to match for the sender.
     if (!radio.set_tx_address(rf24address, addr_width)){printf("failed to set tx address\n"); return EXIT_FAILURE ;}
     if (!radio.set_rx_address(0, rf24address, addr_width)){printf("failed to set tx address\n"); return EXIT_FAILURE ;}
 
-    radio.write((uint8_t*)szMessage, strlen(szMessage), opt_block) ;
-    if (!opt_block) sleep(1) ; // sleep to give the transmit a chance
+    if (opt_file){
+      FILE *f = strcmp(szFile, "-") == 0?stdin:fopen(szFile, "rb") ;
+      if (!f){
+	fprintf(stderr, "Cannot open %s\n", szFile) ;
+	return EXIT_FAILURE ;
+      }
+      // The stream blocks as the radio sends so the file goes at air rate
+      uint8_t chunk[1024] ;
+      size_t len = 0 ;
+      while ((len = fread(chunk, 1, sizeof(chunk), f)) > 0){
+	if (radio.write_stream(chunk, len) < len) break ;
+      }
+      if (!radio.flush_stream()) fprintf(stderr, "Stream failed, status %d\n", radio.get_status()) ;
+      if (f != stdin) fclose(f) ;
+    }else{
+      radio.write((uint8_t*)szMessage, strlen(szMessage), opt_block) ;
+      if (!opt_block) sleep(1) ; // sleep to give the transmit a chance
+    }
   }
   radio.reset_rf24();
   pi.output(opt_ce, IHardwareGPIO::low);
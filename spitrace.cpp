@@ -0,0 +1,308 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "spitrace.hpp"
+#include "rf24time.hpp"
+#include <string.h>
+#include <stdlib.h>
+
+#define TRACE_MAGIC "RF24TRC1"
+#define TRACE_MAGIC_LEN 8
+// Timestamp, tag, length and MISO flag before the frame bytes
+#define TRACE_RECORD_MIN 7
+#define RF24_WRITE_REG 0x20
+#define RF24_REG_CMD_MASK 0xE0
+#define RF24_REG_MASK 0x1F
+
+static bool write_u32(FILE *f, uint32_t val)
+{
+  uint8_t b[4] = {(uint8_t)val, (uint8_t)(val >> 8),
+		  (uint8_t)(val >> 16), (uint8_t)(val >> 24)} ;
+  return fwrite(b, 1, 4, f) == 4 ;
+}
+
+static bool read_u32(FILE *f, uint32_t *val)
+{
+  uint8_t b[4] ;
+  if (fread(b, 1, 4, f) != 4) return false ;
+  *val = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24) ;
+  return true ;
+}
+
+SPITrace::SPITrace(IHardwareSPI *pSPI, uint32_t records)
+{
+  m_pSPI = pSPI ;
+  m_capacity = records ;
+  m_records = new SPITraceRecord[m_capacity] ;
+  m_tag_count = 0 ;
+  m_tag = RF24_TRACE_NO_TAG ;
+  clear() ;
+}
+
+SPITrace::~SPITrace()
+{
+  delete[] m_records ;
+}
+
+bool SPITrace::mark(const char *name)
+{
+  if (!name){
+    m_tag = RF24_TRACE_NO_TAG ;
+    return true ;
+  }
+  for (uint8_t i=0; i < m_tag_count; i++){
+    if (strcmp(m_tags[i], name) == 0){
+      m_tag = i ;
+      return true ;
+    }
+  }
+  if (m_tag_count >= RF24_TRACE_MAX_TAGS) return false ;
+  m_tags[m_tag_count] = name ;
+  m_tag = m_tag_count++ ;
+  return true ;
+}
+
+void SPITrace::clear()
+{
+  m_head = 0 ;
+  m_total = 0 ;
+  m_dropped = 0 ;
+  m_last = NULL ;
+}
+
+uint32_t SPITrace::count()
+{
+  return m_total < m_capacity?m_total:m_capacity ;
+}
+
+const SPITraceRecord *SPITrace::get(uint32_t index)
+{
+  uint32_t n = count() ;
+  if (index >= n) return NULL ;
+  // Oldest record sits at the head once the ring has wrapped
+  uint32_t start = m_total < m_capacity?0:m_head ;
+  return &m_records[(start + index) % m_capacity] ;
+}
+
+bool SPITrace::setCSHigh(bool high)
+{
+  return m_pSPI->setCSHigh(high) ;
+}
+
+bool SPITrace::setMode(uint8_t mode)
+{
+  return m_pSPI->setMode(mode) ;
+}
+
+bool SPITrace::setSpeed(uint32_t speed)
+{
+  return m_pSPI->setSpeed(speed) ;
+}
+
+bool SPITrace::write(uint8_t *buffer, uint32_t len)
+{
+  SPITraceRecord *rec = &m_records[m_head] ;
+  if (m_total >= m_capacity) m_dropped++ ;
+  m_head = (m_head + 1) % m_capacity ;
+  m_total++ ;
+
+  rec->timestamp = rf24_micros() ;
+  rec->tag = m_tag ;
+  rec->len = len > RF24_TRACE_FRAME?RF24_TRACE_FRAME:len ;
+  rec->has_miso = false ;
+  memcpy(rec->mosi, buffer, rec->len) ;
+  m_last = rec ;
+
+  return m_pSPI->write(buffer, len) ;
+}
+
+bool SPITrace::read(uint8_t *buffer, uint32_t len)
+{
+  bool ret = m_pSPI->read(buffer, len) ;
+  if (ret && m_last){
+    uint8_t n = len > m_last->len?m_last->len:len ;
+    memcpy(m_last->miso, buffer, n) ;
+    m_last->has_miso = true ;
+    m_last = NULL ;
+  }
+  return ret ;
+}
+
+bool SPITrace::dump(const char *filename)
+{
+  FILE *f = fopen(filename, "wb") ;
+  if (!f) return false ;
+  uint32_t n = count() ;
+  bool ret = fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, f) == TRACE_MAGIC_LEN ;
+  ret = ret && write_u32(f, n) ;
+  ret = ret && fputc(m_tag_count, f) != EOF ;
+  for (uint8_t i=0; ret && i < m_tag_count; i++){
+    uint8_t tlen = strlen(m_tags[i]) > 0xFF?0xFF:strlen(m_tags[i]) ;
+    ret = fputc(tlen, f) != EOF && fwrite(m_tags[i], 1, tlen, f) == tlen ;
+  }
+  for (uint32_t i=0; ret && i < n; i++){
+    const SPITraceRecord *rec = get(i) ;
+    uint8_t hdr[3] = {rec->tag, rec->len, rec->has_miso} ;
+    ret = write_u32(f, rec->timestamp) &&
+      fwrite(hdr, 1, 3, f) == 3 &&
+      fwrite(rec->mosi, 1, rec->len, f) == rec->len ;
+    if (ret && rec->has_miso)
+      ret = fwrite(rec->miso, 1, rec->len, f) == rec->len ;
+  }
+  if (fclose(f) != 0) return false ;
+  return ret ;
+}
+
+void SPITrace::print_summary(FILE *out)
+{
+  // One extra slot for untagged transfers
+  uint32_t trans[RF24_TRACE_MAX_TAGS+1], bytes[RF24_TRACE_MAX_TAGS+1],
+    repeats[RF24_TRACE_MAX_TAGS+1] ;
+  bool reg_known[RF24_REG_MASK+1] ;
+  uint32_t n = count() ;
+
+  memset(trans, 0, sizeof(trans)) ;
+  memset(bytes, 0, sizeof(bytes)) ;
+  memset(repeats, 0, sizeof(repeats)) ;
+  memset(reg_known, 0, sizeof(reg_known)) ;
+
+  for (uint32_t i=0; i < n; i++){
+    const SPITraceRecord *rec = get(i) ;
+    uint8_t t = rec->tag == RF24_TRACE_NO_TAG?RF24_TRACE_MAX_TAGS:rec->tag ;
+    uint8_t cmd = rec->mosi[0] ;
+    trans[t]++ ;
+    bytes[t] += rec->len ;
+    if ((cmd & RF24_REG_CMD_MASK) == 0){
+      // Register read. Repeated if nothing has written since the last read
+      if (reg_known[cmd & RF24_REG_MASK]) repeats[t]++ ;
+      reg_known[cmd & RF24_REG_MASK] = true ;
+    }else if ((cmd & RF24_REG_CMD_MASK) == RF24_WRITE_REG){
+      reg_known[cmd & RF24_REG_MASK] = false ;
+    }else{
+      // Any other command can change status and FIFO registers
+      memset(reg_known, 0, sizeof(reg_known)) ;
+    }
+  }
+
+  fprintf(out, "%-20s %10s %10s %10s\n", "API", "SPI", "BYTES", "REPEATED") ;
+  for (uint8_t i=0; i <= RF24_TRACE_MAX_TAGS; i++){
+    if (trans[i] == 0) continue ;
+    fprintf(out, "%-20s %10u %10u %10u\n",
+	    i == RF24_TRACE_MAX_TAGS?"(none)":m_tags[i],
+	    trans[i], bytes[i], repeats[i]) ;
+  }
+  if (m_dropped) fprintf(out, "%u oldest records dropped\n", m_dropped) ;
+}
+
+SPIReplay::SPIReplay()
+{
+  m_records = NULL ;
+  m_count = 0 ;
+  m_tag_count = 0 ;
+  rewind() ;
+}
+
+SPIReplay::~SPIReplay()
+{
+  delete[] m_records ;
+  for (uint8_t i=0; i < m_tag_count; i++) free(m_tags[i]) ;
+}
+
+void SPIReplay::rewind()
+{
+  m_pos = 0 ;
+  m_mismatch = 0 ;
+  m_last = NULL ;
+}
+
+const char *SPIReplay::get_tag(uint8_t tag)
+{
+  if (tag >= m_tag_count) return NULL ;
+  return m_tags[tag] ;
+}
+
+bool SPIReplay::load(const char *filename)
+{
+  char magic[TRACE_MAGIC_LEN] ;
+  uint32_t n = 0 ;
+  int c = 0 ;
+  long size = 0, start = 0 ;
+  bool ret = false ;
+  FILE *f = fopen(filename, "rb") ;
+  if (!f) return false ;
+
+  if (fread(magic, 1, TRACE_MAGIC_LEN, f) != TRACE_MAGIC_LEN ||
+      memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0 ||
+      !read_u32(f, &n) || (c = fgetc(f)) == EOF || c > RF24_TRACE_MAX_TAGS){
+    fclose(f) ;
+    return false ;
+  }
+
+  // Check the record count fits the file before allocating for it
+  start = ftell(f) ;
+  if (start < 0 || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < start ||
+      fseek(f, start, SEEK_SET) != 0 ||
+      n > RF24_TRACE_MAX_RECORDS || n > (uint32_t)((size - start) / TRACE_RECORD_MIN)){
+    fclose(f) ;
+    return false ;
+  }
+
+  delete[] m_records ;
+  for (uint8_t i=0; i < m_tag_count; i++) free(m_tags[i]) ;
+  m_tag_count = 0 ;
+  m_records = new SPITraceRecord[n] ;
+  m_count = 0 ;
+
+  for (int i=0; i < c; i++){
+    int tlen = fgetc(f) ;
+    if (tlen == EOF) goto done ;
+    m_tags[i] = (char *)calloc(tlen+1, 1) ;
+    m_tag_count++ ;
+    if (fread(m_tags[i], 1, tlen, f) != (size_t)tlen) goto done ;
+  }
+  for (m_count=0; m_count < n; m_count++){
+    SPITraceRecord *rec = &m_records[m_count] ;
+    uint8_t hdr[3] ;
+    if (!read_u32(f, &rec->timestamp) || fread(hdr, 1, 3, f) != 3) goto done ;
+    rec->tag = hdr[0] ;
+    rec->len = hdr[1] > RF24_TRACE_FRAME?RF24_TRACE_FRAME:hdr[1] ;
+    rec->has_miso = hdr[2] != 0 ;
+    if (fread(rec->mosi, 1, rec->len, f) != rec->len) goto done ;
+    if (rec->has_miso && fread(rec->miso, 1, rec->len, f) != rec->len) goto done ;
+  }
+  ret = true ;
+done:
+  fclose(f) ;
+  rewind() ;
+  return ret ;
+}
+
+bool SPIReplay::write(uint8_t *buffer, uint32_t len)
+{
+  if (m_pos >= m_count) return false ; // recording exhausted
+  m_last = &m_records[m_pos++] ;
+  if (len != m_last->len || memcmp(buffer, m_last->mosi, m_last->len) != 0)
+    m_mismatch++ ;
+  return true ;
+}
+
+bool SPIReplay::read(uint8_t *buffer, uint32_t len)
+{
+  if (!m_last) return false ;
+  memset(buffer, 0, len) ;
+  if (m_last->has_miso)
+    memcpy(buffer, m_last->miso, len > m_last->len?m_last->len:len) ;
+  m_last = NULL ;
+  return true ;
+}
@@ -0,0 +1,123 @@
+//   Copyright 2020 Aidan Holmes
+
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef __RF24_SPI_TRACE
+#define __RF24_SPI_TRACE
+
+#include "hardware.hpp"
+#include "rpinrf24.hpp"
+#include <stdio.h>
+
+// Largest SPI frame used by the driver. Command byte plus a full payload
+#define RF24_TRACE_FRAME (MAX_RXTXBUF+1)
+#define RF24_TRACE_DEFAULT_RECORDS 4096
+#define RF24_TRACE_MAX_TAGS 32
+// Largest trace accepted by SPIReplay::load
+#define RF24_TRACE_MAX_RECORDS 1048576
+#define RF24_TRACE_NO_TAG 0xFF
+
+// A single chip select delimited transfer. The first MOSI byte is the command
+struct SPITraceRecord{
+  uint32_t timestamp ; // micro seconds, see rf24_micros()
+  uint8_t tag ; // index into the tag table or RF24_TRACE_NO_TAG
+  uint8_t len ; // bytes clocked including the command byte
+  bool has_miso ; // false if the caller never read back the transfer
+  uint8_t mosi[RF24_TRACE_FRAME] ;
+  uint8_t miso[RF24_TRACE_FRAME] ;
+};
+
+// Wraps the SPI interface given to NordicRF24 and records every transfer
+// into a fixed ring buffer. Oldest records are overwritten when full.
+// Not thread safe - trace from one thread or hold m_rwlock for the whole
+// write/read pair as the driver already does in most paths.
+class SPITrace : public IHardwareSPI{
+public:
+  SPITrace(IHardwareSPI *pSPI, uint32_t records = RF24_TRACE_DEFAULT_RECORDS) ;
+  ~SPITrace() ;
+
+  // Label following transfers with the calling API, i.e. "initialise".
+  // name must remain valid (use string literals). NULL clears the tag.
+  // Returns false if the tag table is full
+  bool mark(const char *name) ;
+
+  // Drop all recorded transfers. Tags are retained
+  void clear() ;
+  uint32_t count() ;
+  uint32_t dropped(){return m_dropped;}
+  // Record in time order where 0 is the oldest. Returns NULL if out of range
+  const SPITraceRecord *get(uint32_t index) ;
+
+  // Write the trace to a binary file which can be loaded by SPIReplay
+  bool dump(const char *filename) ;
+
+  // Print transactions, bytes and repeated register reads for each tag.
+  // A repeated read is a read of a register with no write in between
+  void print_summary(FILE *out) ;
+
+  // IHardwareSPI
+  bool setCSHigh(bool high) ;
+  bool setMode(uint8_t mode) ;
+  bool setSpeed(uint32_t speed) ;
+  bool write(uint8_t *buffer, uint32_t len) ;
+  bool read(uint8_t *buffer, uint32_t len) ;
+
+protected:
+  IHardwareSPI *m_pSPI ;
+  SPITraceRecord *m_records ;
+  uint32_t m_capacity ;
+  uint32_t m_head ; // next record to write
+  uint32_t m_total ; // total records written
+  uint32_t m_dropped ;
+  const char *m_tags[RF24_TRACE_MAX_TAGS] ;
+  uint8_t m_tag_count ;
+  uint8_t m_tag ;
+  SPITraceRecord *m_last ; // last write waiting for a read
+};
+
+// Feeds recorded MISO data back to the driver in place of the radio.
+// MOSI data is compared against the recording to detect divergence.
+class SPIReplay : public IHardwareSPI{
+public:
+  SPIReplay() ;
+  ~SPIReplay() ;
+
+  // Load a file written with SPITrace::dump
+  bool load(const char *filename) ;
+  // Start replaying from the first record again
+  void rewind() ;
+  uint32_t count(){return m_count;}
+  uint32_t position(){return m_pos;}
+  // Number of writes which differed from the recording
+  uint32_t mismatches(){return m_mismatch;}
+  const char *get_tag(uint8_t tag) ;
+
+  // IHardwareSPI
+  bool setCSHigh(bool high){return true;}
+  bool setMode(uint8_t mode){return true;}
+  bool setSpeed(uint32_t speed){return true;}
+  // Fails when the recording has been exhausted
+  bool write(uint8_t *buffer, uint32_t len) ;
+  bool read(uint8_t *buffer, uint32_t len) ;
+
+protected:
+  SPITraceRecord *m_records ;
+  uint32_t m_count ;
+  uint32_t m_pos ;
+  uint32_t m_mismatch ;
+  char *m_tags[RF24_TRACE_MAX_TAGS] ;
+  uint8_t m_tag_count ;
+  SPITraceRecord *m_last ;
+};
+
+#endif